@@ -0,0 +1,173 @@
+#include "socket.h"
+#include "flags.h"
+#include "stats.h"
+#include "procfs.h"
+
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+DEFINE_int(dstport, 1234, "tcp_server port");
+DEFINE_string(dstip, "127.0.0.1", "tcp_server ip");
+DEFINE_int(pid, -1, "tcp_server pid to sample rss/fds/threads from /proc");
+DEFINE_int(target, 10000, "connections to ramp up to");
+DEFINE_int(step, 1000, "connections added per step");
+DEFINE_int(srcips, 4, "spread connections over source ips 127.0.0.1 .. 127.0.0.N");
+DEFINE_int(active, 0, "connections kept busy echoing while ramping");
+DEFINE_int(samples, 200, "idle connections probed for echo latency per step");
+DEFINE_int(size, 64, "echo payload size");
+
+namespace {
+using namespace testing;
+
+Socket OpenConnection(size_t index) {
+    std::string src = "127.0.0." + std::to_string(1 + index % std::max(FLAG_srcips, 1));
+
+    auto s = CreateSocket(
+        SOCK_STREAM,
+        WithSocketOpts(BindAddressNoPortSockOpt()),
+        WithTimeoutOpt(2, 2),
+        WithBind(MakeAddress4(0, src.c_str())));
+
+    s.Connect(MakeAddress4(FLAG_dstport, FLAG_dstip));
+    return s;
+}
+
+bool Echo(Socket& s, std::string& req, std::string& rsp) {
+    if (s.Send(MakeBuffer(req)) != static_cast<int>(req.size())) {
+        return false;
+    }
+
+    size_t got = 0;
+    while (got < rsp.size()) {
+        int n = s.Recv({ &rsp[got], rsp.size() - got });
+        if (n <= 0) {
+            return false;
+        }
+
+        got += n;
+    }
+
+    return true;
+}
+}
+
+int main(int argc, char *argv[]) {
+    if (!FlagList::ParseCommandLine(argc, argv)) {
+        FlagList::Print(std::cerr);
+        return -1;
+    }
+
+    long limit = RaiseOpenFileLimit();
+    if (limit < FLAG_target + 16) {
+        std::cerr << "RLIMIT_NOFILE " << limit << " caps the ramp, raise it with ulimit -n" << std::endl;
+    }
+
+    ProcessSample base;
+    if (FLAG_pid > 0) {
+        base = SampleProcess(FLAG_pid);
+    }
+
+    std::vector<Socket> idle;
+    idle.reserve(FLAG_target);
+
+    std::atomic_bool stop = false;
+    std::atomic<uint64_t> active_echoes = 0;
+    std::thread active_thread;
+
+    try {
+        std::vector<Socket> active;
+        for (int i = 0; i < FLAG_active; ++i) {
+            active.emplace_back(OpenConnection(i));
+        }
+
+        // round robin ping-pong over the busy connections
+        active_thread = std::thread([&, active = std::move(active)]() mutable {
+            std::string req(FLAG_size, 'a');
+            std::string rsp(FLAG_size, '\0');
+            for (size_t i = 0; !stop && !active.empty(); i = (i + 1) % active.size()) {
+                if (!Echo(active[i], req, rsp)) {
+                    std::cerr << "active echo err" << std::endl;
+                    break;
+                }
+
+                active_echoes.fetch_add(1, std::memory_order_relaxed);
+            }
+        });
+    } catch (const SocketException& e) {
+        std::cerr << e.what() << '\t' << e.error_code().message() << std::endl;
+        return -1;
+    }
+
+    std::cout << std::setw(10) << "conns"
+              << std::setw(10) << "rss(MB)"
+              << std::setw(10) << "fds"
+              << std::setw(10) << "threads"
+              << std::setw(12) << "KB/conn"
+              << std::setw(12) << "active/s";
+    LatencyStats::PrintHeader(std::cout);
+    std::cout << std::endl;
+
+    std::string req(FLAG_size, 'x');
+    std::string rsp(FLAG_size, '\0');
+    uint64_t last_echoes = 0;
+    uint64_t last_time = NowNanos();
+
+    bool full = false;
+    while (!full && static_cast<int>(idle.size()) < FLAG_target) {
+        size_t next = std::min<size_t>(idle.size() + std::max(FLAG_step, 1), FLAG_target);
+        try {
+            while (idle.size() < next) {
+                idle.emplace_back(OpenConnection(FLAG_active + idle.size()));
+            }
+        } catch (const SocketException& e) {
+            std::cerr << "stop at " << idle.size() << ": " << e.what() << '\t' << e.error_code().message() << std::endl;
+            full = true;
+        }
+
+        // let the server finish spawning per connection state
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        LatencyStats lat;
+        size_t probes = std::min<size_t>(FLAG_samples, idle.size());
+        for (size_t i = 0; i < probes; ++i) {
+            auto& s = idle[i * idle.size() / probes];
+            uint64_t t0 = NowNanos();
+            if (Echo(s, req, rsp)) {
+                lat.Add(NowNanos() - t0);
+            }
+        }
+
+        uint64_t now = NowNanos();
+        uint64_t echoes = active_echoes;
+        double active_rate = (echoes - last_echoes) / ((now - last_time) / 1e9);
+        last_echoes = echoes;
+        last_time = now;
+
+        size_t conns = idle.size() + FLAG_active;
+        std::cout << std::setw(10) << conns;
+        if (FLAG_pid > 0) {
+            auto sample = SampleProcess(FLAG_pid);
+            std::cout << std::fixed << std::setprecision(1)
+                      << std::setw(10) << sample.rss_kb / 1024.0
+                      << std::setw(10) << sample.fds
+                      << std::setw(10) << sample.threads
+                      << std::setprecision(2)
+                      << std::setw(12) << static_cast<double>(sample.rss_kb - base.rss_kb) / conns;
+        } else {
+            std::cout << std::setw(10) << '-' << std::setw(10) << '-'
+                      << std::setw(10) << '-' << std::setw(12) << '-';
+        }
+
+        std::cout << std::fixed << std::setprecision(0) << std::setw(12) << active_rate;
+        lat.Print(std::cout);
+        std::cout << std::endl;
+    }
+
+    stop = true;
+    active_thread.join();
+    return 0;
+}
@@ -0,0 +1,160 @@
+#ifndef _CAPTURE_H_INCLUDED
+#define _CAPTURE_H_INCLUDED
+
+#include "socket.h"
+#include "stats.h"
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace testing {
+// append-only capture file: the magic, then records of a fixed header, the
+// raw peer sockaddr and the payload, back to back in host byte order
+static constexpr char kCaptureMagic[8] = { 'S', 'R', 'T', 'C', 'A', 'P', '0', '1' };
+
+struct CaptureRecordHeader {
+    uint64_t timestamp_ns;  // steady clock, only differences are meaningful
+    uint32_t size;          // payload bytes
+    uint8_t type;           // SOCK_DGRAM or SOCK_STREAM
+    uint8_t addrlen;        // peer sockaddr bytes following the header
+    uint16_t reserved;
+};
+
+static_assert(sizeof(CaptureRecordHeader) == 16, "capture record header must stay 16 bytes");
+
+// shared by every worker of a server, records are buffered and written under
+// a lock and stamped while it is held, so the file is in timestamp order
+class CaptureWriter {
+public:
+    static constexpr size_t kBufferSize = 1 << 20;
+
+    explicit CaptureWriter(const char *path) {
+        file_ = fopen(path, "ab");
+        if (!file_) {
+            CheckAndThrowIfERR("fopen", errno);
+        }
+
+        setvbuf(file_, nullptr, _IOFBF, kBufferSize);
+        fseek(file_, 0, SEEK_END);
+        if (0 == ftell(file_)) {
+            fwrite(kCaptureMagic, sizeof kCaptureMagic, 1, file_);
+        }
+    }
+
+    CaptureWriter(const CaptureWriter&) = delete;
+    CaptureWriter& operator=(const CaptureWriter&) = delete;
+
+    ~CaptureWriter() {
+        fclose(file_);
+    }
+
+    void Write(int type, const SocketAddress& peer, ConstBuffer buf) {
+        CaptureRecordHeader h = {};
+        h.size = static_cast<uint32_t>(buf.second);
+        h.type = static_cast<uint8_t>(type);
+        h.addrlen = static_cast<uint8_t>(std::min<socklen_t>(peer.size(), 255));
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        h.timestamp_ns = NowNanos();
+        fwrite(&h, sizeof h, 1, file_);
+        fwrite(peer.sa(), h.addrlen, 1, file_);
+        fwrite(buf.first, buf.second, 1, file_);
+    }
+
+private:
+    std::mutex mutex_;
+    FILE *file_;
+};
+
+#ifndef _WIN32
+struct CaptureRecord {
+    CaptureRecordHeader header;
+    const char *addr;
+    const char *payload;
+};
+
+// maps a whole capture read only and walks it without copying
+class CaptureReader {
+public:
+    CaptureReader() = default;
+    CaptureReader(const CaptureReader&) = delete;
+    CaptureReader& operator=(const CaptureReader&) = delete;
+
+    ~CaptureReader() {
+        if (data_) {
+            munmap(const_cast<char *>(data_), size_);
+        }
+    }
+
+    void Open(const char *path) {
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+            CheckAndThrowIfERR("open", errno);
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            int err = errno;
+            close(fd);
+            CheckAndThrowIfERR("fstat", { err, std::system_category() });
+        }
+
+        size_ = static_cast<size_t>(st.st_size);
+        if (size_ < sizeof kCaptureMagic) {
+            close(fd);
+            CheckAndThrowIfERR("capture", std::make_error_code(std::errc::invalid_argument));
+        }
+
+        void *p = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        int err = errno;
+        close(fd);
+        if (MAP_FAILED == p) {
+            CheckAndThrowIfERR("mmap", { err, std::system_category() });
+        }
+
+        data_ = static_cast<const char *>(p);
+        madvise(p, size_, MADV_SEQUENTIAL);
+        if (0 != memcmp(data_, kCaptureMagic, sizeof kCaptureMagic)) {
+            CheckAndThrowIfERR("capture magic", std::make_error_code(std::errc::invalid_argument));
+        }
+    }
+
+    size_t begin() const {
+        return sizeof kCaptureMagic;
+    }
+
+    // reads the record at *offset and moves it to the next one, false at the
+    // end or on a record truncated by a server that did not flush
+    bool Next(size_t *offset, CaptureRecord *record) const {
+        if (*offset + sizeof(CaptureRecordHeader) > size_) {
+            return false;
+        }
+
+        // records are packed back to back, so the header may be unaligned
+        memcpy(&record->header, data_ + *offset, sizeof(CaptureRecordHeader));
+        size_t end = *offset + sizeof(CaptureRecordHeader) + record->header.addrlen + record->header.size;
+        if (end > size_) {
+            return false;
+        }
+
+        record->addr = data_ + *offset + sizeof(CaptureRecordHeader);
+        record->payload = record->addr + record->header.addrlen;
+        *offset = end;
+        return true;
+    }
+
+private:
+    const char *data_ = nullptr;
+    size_t size_ = 0;
+};
+#endif
+}
+
+#endif // !_CAPTURE_H_INCLUDED
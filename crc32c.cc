@@ -0,0 +1,145 @@
+#include "crc32c.h"
+
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+using namespace testing;
+
+namespace {
+constexpr uint32_t kPolyReversed = 0x82f63b78;
+
+struct SlicingTables {
+    SlicingTables() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int k = 0; k < 8; ++k) {
+                crc = (crc >> 1) ^ ((crc & 1) ? kPolyReversed : 0);
+            }
+            t[0][i] = crc;
+        }
+
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+            }
+        }
+    }
+
+    uint32_t t[8][256];
+};
+
+const SlicingTables kTables;
+
+uint32_t Crc32cPortable(const void *data, size_t n, uint32_t crc) {
+    const auto *p = static_cast<const unsigned char *>(data);
+    const auto& t = kTables.t;
+    crc = ~crc;
+
+    // eight bytes per step, little endian loads
+    while (n >= 8) {
+        uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24));
+        uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | (static_cast<uint32_t>(p[7]) << 24);
+        crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+            ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+
+    while (n--) {
+        crc = (crc >> 8) ^ t[0][(crc ^ *p++) & 0xff];
+    }
+
+    return ~crc;
+}
+
+#if CRC32C_X86
+__attribute__((target("sse4.2")))
+uint32_t Crc32cSse42(const void *data, size_t n, uint32_t crc) {
+    const auto *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+
+#if defined(__x86_64__)
+    uint64_t crc64 = crc;
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        crc64 = _mm_crc32_u64(crc64, v);
+        p += 8;
+        n -= 8;
+    }
+    crc = static_cast<uint32_t>(crc64);
+#endif
+
+    while (n >= 4) {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        crc = _mm_crc32_u32(crc, v);
+        p += 4;
+        n -= 4;
+    }
+
+    while (n--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+
+    return ~crc;
+}
+#endif
+
+#if CRC32C_ARM
+uint32_t Crc32cArm(const void *data, size_t n, uint32_t crc) {
+    const auto *p = static_cast<const unsigned char *>(data);
+    crc = ~crc;
+
+    while (n >= 8) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        crc = __crc32cd(crc, v);
+        p += 8;
+        n -= 8;
+    }
+
+    while (n--) {
+        crc = __crc32cb(crc, *p++);
+    }
+
+    return ~crc;
+}
+#endif
+
+using Crc32cFunc = uint32_t (*)(const void *, size_t, uint32_t);
+
+struct Dispatch {
+    Crc32cFunc func = Crc32cPortable;
+    const char *name = "portable";
+
+    Dispatch() {
+#if CRC32C_X86
+        if (__builtin_cpu_supports("sse4.2")) {
+            func = Crc32cSse42;
+            name = "sse4.2";
+        }
+#elif CRC32C_ARM
+        func = Crc32cArm;
+        name = "armv8-crc";
+#endif
+    }
+};
+
+const Dispatch kDispatch;
+}
+
+uint32_t testing::Crc32c(const void *data, size_t n, uint32_t crc) {
+    return kDispatch.func(data, n, crc);
+}
+
+const char *testing::Crc32cImplementation() {
+    return kDispatch.name;
+}
@@ -0,0 +1,17 @@
+#ifndef _CRC32C_H_INCLUDED
+#define _CRC32C_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+
+namespace testing {
+// CRC-32C (Castagnoli), the checksum of iSCSI/ext4/SCTP. Pass the previous
+// result as crc to checksum a buffer in pieces. Uses the SSE4.2 or ARMv8
+// crc32c instruction when the cpu has it, slicing-by-8 tables otherwise.
+uint32_t Crc32c(const void *data, size_t n, uint32_t crc = 0);
+
+// which implementation Crc32c dispatched to, for reports
+const char *Crc32cImplementation();
+}
+
+#endif // !_CRC32C_H_INCLUDED
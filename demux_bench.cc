@@ -0,0 +1,243 @@
+#include "socket.h"
+#include "flags.h"
+#include "stats.h"
+#include "procfs.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+DEFINE_int(port, 1235, "loopback port the server side binds");
+DEFINE_string(peers, "1,10,100,1000,8000", "peer counts to measure");
+DEFINE_int(rounds, 20, "datagrams each peer sends per mode");
+DEFINE_int(batch, 64, "datagrams sent before the server side drains them");
+DEFINE_int(size, 16, "payload size");
+
+namespace {
+using namespace testing;
+
+// one process plays both sides of udp_server -connect without threads, so
+// the two costs that change with the number of peers are timed apart: a
+// send on loopback delivers the datagram in the sender's syscall, which
+// makes the kernel's choice of receiving socket part of the client's send
+// time; the server time is recv, finding the peer and the reply. Wildcard
+// is one socket that looks the peer up in a hash map like the FlowEngine
+// wildcard path, connected is one connected socket per peer picked by
+// epoll.
+struct Result {
+    double send_ns;
+    double server_ns;
+    uint64_t echoed;
+};
+
+uint64_t PeerKey(const SocketAddress& peer) {
+    return (uint64_t(peer.v4()->sin_addr.s_addr) << 16) | peer.v4()->sin_port;
+}
+
+// the server learns every peer from its first datagram, as udp_server does
+std::vector<SocketAddress> Introduce(Socket& server, std::vector<Socket>& clients, char *xxx, size_t size) {
+    std::vector<SocketAddress> peers(clients.size());
+    for (size_t i = 0; i < clients.size(); ++i) {
+        clients[i].Send({ xxx, 1 });
+        server.RecvFrom({ xxx, size }, peers[i]);
+    }
+
+    return peers;
+}
+
+void DrainClients(std::vector<Socket>& clients, size_t from, size_t to, char *xxx, size_t size) {
+    for (size_t i = from; i < to; ++i) {
+        while (clients[i].Recv({ xxx, size }, MSG_DONTWAIT) >= 0) {}
+    }
+}
+
+template<typename Drain>
+Result Measure(std::vector<Socket>& clients, const std::string& payload, Drain&& drain) {
+    char xxx[1024];
+    uint64_t send_ns = 0;
+    uint64_t server_ns = 0;
+    uint64_t echoed = 0;
+    size_t batch = std::max(FLAG_batch, 1);
+
+    for (int round = 0; round < FLAG_rounds; ++round) {
+        for (size_t first = 0; first < clients.size(); first += batch) {
+            size_t last = std::min(first + batch, clients.size());
+
+            uint64_t t0 = NowNanos();
+            for (size_t i = first; i < last; ++i) {
+                clients[i].Send(MakeBuffer(payload));
+            }
+            uint64_t t1 = NowNanos();
+            echoed += drain(last - first);
+            uint64_t t2 = NowNanos();
+
+            send_ns += t1 - t0;
+            server_ns += t2 - t1;
+            DrainClients(clients, first, last, xxx, sizeof xxx);
+        }
+    }
+
+    double n = double(clients.size()) * FLAG_rounds;
+    return { send_ns / n, server_ns / n, echoed };
+}
+
+Result RunWildcard(std::vector<Socket>& clients, const std::string& payload) {
+    auto server = CreateSocket(SOCK_DGRAM, WithBind(MakeAddress4(FLAG_port)));
+    for (auto& c : clients) {
+        c.Connect(MakeAddress4(FLAG_port));
+    }
+
+    char xxx[1024];
+    auto peers = Introduce(server, clients, xxx, sizeof xxx);
+    std::unordered_map<uint64_t, uint64_t> seen;
+    for (auto& peer : peers) {
+        seen.emplace(PeerKey(peer), 0);
+    }
+
+    return Measure(clients, payload, [&](size_t expected) {
+        SocketAddress peer;
+        uint64_t n = 0;
+        while (n < expected) {
+            int r = server.RecvFrom(MakeBuffer(xxx), peer, MSG_DONTWAIT);
+            if (r < 0) {
+                break;
+            }
+
+            auto it = seen.find(PeerKey(peer));
+            if (seen.end() != it) {
+                ++it->second;
+            }
+
+            server.SendTo({ xxx, static_cast<size_t>(r) }, peer);
+            ++n;
+        }
+
+        return n;
+    });
+}
+
+Result RunConnected(std::vector<Socket>& clients, const std::string& payload) {
+    auto wildcard = CreateSocket(SOCK_DGRAM, WithReuseSocketOpt(false, true), WithBind(MakeAddress4(FLAG_port)));
+    for (auto& c : clients) {
+        c.Connect(MakeAddress4(FLAG_port));
+    }
+
+    char xxx[1024];
+    auto peers = Introduce(wildcard, clients, xxx, sizeof xxx);
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) {
+        CheckAndThrowIfERR("epoll_create1");
+    }
+
+    std::vector<Socket> flows;
+    for (size_t i = 0; i < peers.size(); ++i) {
+        flows.emplace_back(CreateSocket(
+            SOCK_DGRAM,
+            WithReuseSocketOpt(false, true),
+            WithBind(MakeAddress4(FLAG_port)),
+            WithConnect(peers[i])));
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(ep, EPOLL_CTL_ADD, flows.back().native_handle(), &ev);
+    }
+
+    std::vector<epoll_event> events(std::max(FLAG_batch, 1));
+    auto result = Measure(clients, payload, [&](size_t expected) {
+        uint64_t n = 0;
+        while (n < expected) {
+            int ready = epoll_wait(ep, events.data(), static_cast<int>(events.size()), 0);
+            if (ready <= 0) {
+                break;
+            }
+
+            for (int i = 0; i < ready; ++i) {
+                Socket& s = flows[events[i].data.u64];
+                int r;
+                while ((r = s.Recv(MakeBuffer(xxx), MSG_DONTWAIT)) >= 0) {
+                    s.Send({ xxx, static_cast<size_t>(r) });
+                    ++n;
+                }
+            }
+        }
+
+        return n;
+    });
+
+    close(ep);
+    return result;
+}
+
+void Print(size_t peers, const char *mode, const Result& r) {
+    std::cout << std::setw(8) << peers
+              << std::setw(12) << mode
+              << std::fixed << std::setprecision(0)
+              << std::setw(12) << r.send_ns
+              << std::setw(12) << r.server_ns
+              << std::setw(12) << 1e9 / (r.send_ns + r.server_ns)
+              << std::setw(12) << r.echoed << std::endl;
+}
+
+std::vector<size_t> ParsePeers(const char *str) {
+    std::vector<size_t> peers;
+    while (*str) {
+        char *end;
+        long v = strtol(str, &end, 10);
+        if (end == str) {
+            break;
+        }
+
+        if (v > 0) {
+            peers.push_back(static_cast<size_t>(v));
+        }
+
+        str = (',' == *end) ? end + 1 : end;
+    }
+
+    return peers;
+}
+}
+
+int main(int argc, char *argv[]) {
+    if (!FlagList::ParseCommandLine(argc, argv)) {
+        FlagList::Print(std::cerr);
+        return -1;
+    }
+
+    // every peer is a client socket, connected mode adds one more per peer
+    RaiseOpenFileLimit();
+    std::string payload(std::max(FLAG_size, 1), 'x');
+
+    std::cout << std::setw(8) << "peers"
+              << std::setw(12) << "mode"
+              << std::setw(12) << "send ns"
+              << std::setw(12) << "server ns"
+              << std::setw(12) << "pps"
+              << std::setw(12) << "echoed" << std::endl;
+
+    try {
+        for (size_t n : ParsePeers(FLAG_peers)) {
+            for (int connected = 0; connected < 2; ++connected) {
+                std::vector<Socket> clients;
+                for (size_t i = 0; i < n; ++i) {
+                    clients.emplace_back(CreateSocket(SOCK_DGRAM, WithBind(MakeAddress4(0))));
+                }
+
+                Print(n, connected ? "connected" : "wildcard",
+                      connected ? RunConnected(clients, payload) : RunWildcard(clients, payload));
+            }
+        }
+    } catch (const SocketException& e) {
+        std::cerr << e.what() << '\t' << e.error_code().message() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,426 @@
+#include "socket.h"
+#include "flags.h"
+#include "stats.h"
+#include "procfs.h"
+#include "payload.h"
+
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+DEFINE_int(dstport, 1234, "remote port of the loopback server, -1 to skip");
+DEFINE_string(dstip, "127.0.0.1", "remote ip of the loopback server");
+DEFINE_string(unixpath, "", "AF_UNIX path of the same server, '@name' for abstract");
+DEFINE_string(type, "stream", "stream or dgram");
+DEFINE_int(count, 100000, "round trips per transport");
+DEFINE_int(size, 64, "payload size");
+DEFINE_string(rates, "", "open loop msg/s steps like 1000,10000,100000, empty for ping-pong");
+DEFINE_int(seconds, 5, "duration of each open loop step");
+DEFINE_int(pid, -1, "server pid to sample cpu usage from /proc");
+DEFINE_int(clients, 1, "concurrent client sockets per transport, each on its own thread");
+DEFINE_bool(verify, false, "send seeded patterns and check every echo with crc32c");
+DEFINE_int(seed, 1, "pattern seed for -verify");
+DEFINE_int(bulk, 0, "stream N MB per client through the echo in -size writes, 0 off");
+DEFINE_int(peers, 1, "sockets per client in ping-pong, each round trip uses the next one");
+
+namespace {
+using namespace testing;
+
+struct Transport {
+    const char *name;
+    std::vector<Socket> sockets;  // grouped by client, peers apiece
+    size_t peers = 1;
+};
+
+// reads one whole message, returns its length when done, 0 on timeout and
+// -1 on error, a partial stream message is kept in *got across timeouts
+int RecvMessage(Socket& s, bool stream, std::string& buf, size_t *got) {
+    do {
+        int n = s.Recv({ &buf[*got], buf.size() - *got });
+        if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+            return 0;
+        }
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        *got += n;
+    } while (stream && *got < buf.size());
+
+    int n = static_cast<int>(*got);
+    *got = 0;
+    return n;
+}
+
+size_t PayloadSize() {
+    return FLAG_verify ? std::max<size_t>(FLAG_size, PayloadPattern::kMinSize) : FLAG_size;
+}
+
+// closed loop ping-pong, one request in flight per client, round trips
+// rotate over its peers sockets so the server sees that many peers
+void EchoClient(const char *name, Socket *sockets, size_t peers, bool stream, int id, LatencyStats& lat, VerifyStats& verify) {
+    PayloadPattern pattern(PayloadSize(), FLAG_seed + id * 1000);
+    std::string fixed(FLAG_size, 'x');
+    std::string rsp(PayloadSize(), '\0');
+    lat.Reserve(FLAG_count);
+
+    for (int i = 0; i < FLAG_count; ++i) {
+        const std::string& req = FLAG_verify ? pattern.Next() : fixed;
+        Socket& s = sockets[i % peers];
+
+        uint64_t t0 = NowNanos();
+        if (s.Send(MakeBuffer(req)) != static_cast<int>(req.size())) {
+            std::cerr << name << " send err" << std::endl;
+            return;
+        }
+
+        size_t got = 0;
+        int n = RecvMessage(s, stream, rsp, &got);
+        if (n <= 0) {
+            std::cerr << name << " recv err" << std::endl;
+            return;
+        }
+
+        lat.Add(NowNanos() - t0);
+        if (FLAG_verify) {
+            verify.Add(PayloadPattern::Verify(rsp.data(), n, req.size()));
+        }
+    }
+}
+
+// open loop at a fixed rate per client, the send time travels in the
+// payload so latency is measured per message no matter how many are in
+// flight; returns the number of messages sent
+uint64_t LoadClient(Socket& s, bool stream, int id, int rate, LatencyStats& lat, VerifyStats& verify) {
+    size_t size = std::max<size_t>(PayloadSize(), sizeof(uint64_t));
+    uint64_t duration = static_cast<uint64_t>(FLAG_seconds) * 1000000000;
+    uint64_t interval = 1000000000 / std::max(rate, 1);
+
+    std::atomic<uint64_t> sent = 0;
+    std::atomic_bool done = false;
+    uint64_t start = NowNanos();
+
+    std::thread sender([&] {
+        PayloadPattern pattern(size, FLAG_seed + id * 1000);
+        std::string fixed(size, 'x');
+        for (uint64_t due = start; due - start < duration; due += interval) {
+            std::string& req = FLAG_verify ? pattern.Next() : fixed;
+            uint64_t now = SleepUntil(due);
+            memcpy(&req[0], &now, sizeof now);
+            if (s.Send(MakeBuffer(req)) != static_cast<int>(size)) {
+                break;
+            }
+
+            sent.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        done = true;
+    });
+
+    lat.Reserve(static_cast<size_t>(rate) * FLAG_seconds);
+
+    std::string rsp(size, '\0');
+    size_t got = 0;
+    while (!done || lat.count() < sent) {
+        int r = RecvMessage(s, stream, rsp, &got);
+        if (r < 0 || (0 == r && done)) {
+            break;
+        }
+
+        if (r >= static_cast<int>(sizeof(uint64_t))) {
+            uint64_t ts;
+            memcpy(&ts, &rsp[0], sizeof ts);
+            lat.Add(NowNanos() - ts);
+        }
+
+        if (r > 0 && FLAG_verify) {
+            verify.Add(PayloadPattern::Verify(rsp.data(), r, size));
+        }
+    }
+
+    sender.join();
+    return sent;
+}
+
+void PrintVerify(const std::vector<VerifyStats>& stats) {
+    if (!FLAG_verify) {
+        return;
+    }
+
+    VerifyStats total;
+    for (auto&& v : stats) {
+        total.Merge(v);
+    }
+
+    std::cout << std::setw(12) << "verify" << "  " << total
+              << " (crc32c " << Crc32cImplementation() << ')' << std::endl;
+}
+
+void RunEcho(Transport& t, bool stream) {
+    size_t n = t.sockets.size() / t.peers;
+    std::vector<LatencyStats> lats(n);
+    std::vector<VerifyStats> verify(n);
+    std::vector<std::thread> clients;
+
+    uint64_t start = NowNanos();
+    for (size_t i = 0; i < n; ++i) {
+        clients.emplace_back([&, i] {
+            EchoClient(t.name, &t.sockets[i * t.peers], t.peers, stream, static_cast<int>(i), lats[i], verify[i]);
+        });
+    }
+
+    LatencyStats lat;
+    for (size_t i = 0; i < clients.size(); ++i) {
+        clients[i].join();
+        lat.Merge(lats[i]);
+    }
+    double secs = (NowNanos() - start) / 1e9;
+
+    std::cout << std::setw(12) << t.name
+              << std::fixed << std::setprecision(0)
+              << std::setw(12) << lat.count() / secs
+              << std::setprecision(1)
+              << std::setw(12) << 2.0 * lat.count() * PayloadSize() / secs / (1 << 20);
+    lat.Print(std::cout);
+    std::cout << std::endl;
+    PrintVerify(verify);
+}
+
+void RunLoad(Transport& t, bool stream, int rate) {
+    std::vector<LatencyStats> lats(t.sockets.size());
+    std::vector<VerifyStats> verify(t.sockets.size());
+    std::vector<uint64_t> sent(t.sockets.size());
+    std::vector<std::thread> clients;
+
+#ifdef __linux__
+    double cpu0 = FLAG_pid > 0 ? ProcessCpuSeconds(FLAG_pid) : -1;
+#endif
+    uint64_t start = NowNanos();
+    for (size_t i = 0; i < t.sockets.size(); ++i) {
+        clients.emplace_back([&, i] {
+            sent[i] = LoadClient(t.sockets[i], stream, static_cast<int>(i), rate, lats[i], verify[i]);
+        });
+    }
+
+    LatencyStats lat;
+    uint64_t total_sent = 0;
+    for (size_t i = 0; i < clients.size(); ++i) {
+        clients[i].join();
+        lat.Merge(lats[i]);
+        total_sent += sent[i];
+    }
+    double secs = (NowNanos() - start) / 1e9;
+
+    std::cout << std::setw(12) << t.name
+              << std::setw(10) << rate * t.sockets.size()
+              << std::setw(10) << total_sent
+              << std::setw(10) << lat.count();
+    lat.Print(std::cout);
+#ifdef __linux__
+    if (cpu0 >= 0) {
+        std::cout << std::setw(10) << (ProcessCpuSeconds(FLAG_pid) - cpu0) / secs * 100;
+    }
+#endif
+    std::cout << std::endl;
+    PrintVerify(verify);
+}
+
+// one thread writes while another reads the echo back, so neither side
+// waits for a round trip and the transfer runs at the server's pace;
+// returns false when the transfer stopped short
+bool BulkClient(Socket& s, uint64_t total) {
+    std::atomic_bool ok = true;
+    std::thread sender([&] {
+        std::string req(std::max(FLAG_size, 1), 'x');
+        for (uint64_t sent = 0; sent < total && ok;) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(req.size(), total - sent));
+            int r = s.Send({ req.data(), n });
+            if (r <= 0) {
+                ok = false;
+                break;
+            }
+
+            sent += r;
+        }
+    });
+
+    std::string rsp(64 * 1024, '\0');
+    for (uint64_t received = 0; received < total && ok;) {
+        int r = s.Recv(MakeBuffer(rsp));
+        if (r <= 0) {
+            ok = false;
+            break;
+        }
+
+        received += r;
+    }
+
+    sender.join();
+    return ok;
+}
+
+void RunBulk(Transport& t) {
+    uint64_t total = static_cast<uint64_t>(FLAG_bulk) << 20;
+    std::vector<std::thread> clients;
+    std::atomic<int> failed = 0;
+
+#ifdef __linux__
+    double cpu0 = FLAG_pid > 0 ? ProcessCpuSeconds(FLAG_pid) : -1;
+#endif
+    uint64_t start = NowNanos();
+    for (size_t i = 0; i < t.sockets.size(); ++i) {
+        clients.emplace_back([&, i] {
+            if (!BulkClient(t.sockets[i], total)) {
+                ++failed;
+            }
+        });
+    }
+
+    for (auto&& c : clients) {
+        c.join();
+    }
+    double secs = (NowNanos() - start) / 1e9;
+    double mb = static_cast<double>(total) * t.sockets.size() / (1 << 20);
+
+    std::cout << std::setw(12) << t.name
+              << std::fixed << std::setprecision(0)
+              << std::setw(10) << mb
+              << std::setprecision(1)
+              << std::setw(12) << mb / secs;
+#ifdef __linux__
+    if (cpu0 >= 0) {
+        double cpu = ProcessCpuSeconds(FLAG_pid) - cpu0;
+        std::cout << std::setw(10) << cpu / secs * 100
+                  << std::setprecision(3)
+                  << std::setw(14) << cpu / (mb / 1024);
+    }
+#endif
+    if (failed > 0) {
+        std::cout << "  " << failed << " clients failed";
+    }
+    std::cout << std::endl;
+}
+
+std::vector<int> ParseRates(const char *str) {
+    std::vector<int> rates;
+    while (*str) {
+        char *end;
+        long v = strtol(str, &end, 10);
+        if (end == str) {
+            break;
+        }
+
+        if (v > 0) {
+            rates.push_back(static_cast<int>(v));
+        }
+
+        str = (',' == *end) ? end + 1 : end;
+    }
+
+    return rates;
+}
+}
+
+int main(int argc, char *argv[]) {
+    if (!FlagList::ParseCommandLine(argc, argv)) {
+        FlagList::Print(std::cerr);
+        return -1;
+    }
+
+    bool stream = (0 == strcmp(FLAG_type, "stream"));
+    int type = stream ? SOCK_STREAM : SOCK_DGRAM;
+    auto rates = ParseRates(FLAG_rates);
+
+    try {
+#ifdef _WIN32
+        WinsockInitializer<> wsock_initializer;
+#endif
+        // only ping-pong rotates over several sockets per client
+        int peers = (rates.empty() && FLAG_bulk <= 0) ? std::max(FLAG_peers, 1) : 1;
+        int clients = std::max(FLAG_clients, 1);
+#ifdef __linux__
+        if (peers > 1) {
+            RaiseOpenFileLimit();
+        }
+#endif
+
+        std::vector<Transport> transports;
+        if (FLAG_dstport != -1) {
+            transports.push_back({ stream ? "tcp" : "udp", {}, static_cast<size_t>(peers) });
+            for (int i = 0; i < clients * peers; ++i) {
+                auto s = CreateSocket(type, WithTimeoutOpt(2, 2));
+                s.Connect(MakeAddress4(FLAG_dstport, FLAG_dstip));
+                transports.back().sockets.emplace_back(std::move(s));
+            }
+        }
+
+#ifndef _WIN32
+        if (*FLAG_unixpath) {
+            transports.push_back({ stream ? "unix_stream" : "unix_dgram", {}, static_cast<size_t>(peers) });
+            for (int i = 0; i < clients * peers; ++i) {
+                auto s = stream
+                    ? CreateSocketWithFamily(AF_UNIX, type, WithTimeoutOpt(2, 2))
+                    : CreateSocketWithFamily(AF_UNIX, type, WithBind(MakeAddressUnix("")), WithTimeoutOpt(2, 2));
+                s.Connect(MakeAddressUnix(FLAG_unixpath));
+                transports.back().sockets.emplace_back(std::move(s));
+            }
+        }
+#endif
+
+        if (FLAG_bulk > 0) {
+            if (!stream) {
+                std::cerr << "-bulk needs -type stream" << std::endl;
+                return -1;
+            }
+
+            std::cout << std::setw(12) << "transport"
+                      << std::setw(10) << "MB"
+                      << std::setw(12) << "MB/s"
+                      << std::setw(10) << "srv cpu%"
+                      << std::setw(14) << "srv cpu s/GB" << std::endl;
+
+            for (auto&& t : transports) {
+                RunBulk(t);
+            }
+        } else if (rates.empty()) {
+            std::cout << std::setw(12) << "transport"
+                      << std::setw(12) << "msg/s"
+                      << std::setw(12) << "MB/s";
+            LatencyStats::PrintHeader(std::cout);
+            std::cout << std::endl;
+
+            for (auto&& t : transports) {
+                RunEcho(t, stream);
+            }
+        } else {
+            std::cout << std::setw(12) << "transport"
+                      << std::setw(10) << "rate"
+                      << std::setw(10) << "sent"
+                      << std::setw(10) << "recv";
+            LatencyStats::PrintHeader(std::cout);
+            std::cout << std::setw(10) << "srv cpu%" << std::endl;
+
+            for (auto&& t : transports) {
+                // a short timeout lets the receiver notice the tail was lost
+                for (auto&& s : t.sockets) {
+                    s.SetOpt(RcvTimeoutSockOpt(0, 200000));
+                }
+            }
+
+            for (int rate : rates) {
+                for (auto&& t : transports) {
+                    RunLoad(t, stream, rate);
+                }
+            }
+        }
+    } catch (const SocketException& e) {
+        std::cerr << e.what() << '\t' << e.error_code().message() << std::endl;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+#ifndef _PAYLOAD_H_INCLUDED
+#define _PAYLOAD_H_INCLUDED
+
+#include "crc32c.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace testing {
+// self checking payload: a header carrying the size and the CRC-32C of the
+// seeded pattern after it. The stamp is free for the sender (send time) and
+// is not covered by the crc.
+struct PayloadHeader {
+    uint64_t stamp;
+    uint32_t size;
+    uint32_t crc;
+};
+
+enum class PayloadVerdict : uint8_t {
+    kOk,
+    kTruncated,
+    kCorrupt
+};
+
+struct VerifyStats {
+    uint64_t ok = 0;
+    uint64_t truncated = 0;
+    uint64_t corrupt = 0;
+
+    void Add(PayloadVerdict v) {
+        switch (v) {
+        case PayloadVerdict::kOk:        ++ok;        break;
+        case PayloadVerdict::kTruncated: ++truncated; break;
+        case PayloadVerdict::kCorrupt:   ++corrupt;   break;
+        }
+    }
+
+    void Merge(const VerifyStats& other) {
+        ok += other.ok;
+        truncated += other.truncated;
+        corrupt += other.corrupt;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const VerifyStats& v) {
+    return out << "ok " << v.ok << " truncated " << v.truncated << " corrupt " << v.corrupt;
+}
+
+// a ring of payloads built once with distinct patterns and their crc, so
+// sending costs nothing and checking an echo is a single Crc32c pass
+class PayloadPattern {
+public:
+    static constexpr size_t kMinSize = sizeof(PayloadHeader);
+
+    PayloadPattern(size_t size, uint64_t seed, size_t variants = 64)
+        : size_(std::max(size, kMinSize)) {
+        for (size_t i = 0; i < variants; ++i) {
+            std::string p(size_, '\0');
+            Fill(&p[kMinSize], size_ - kMinSize, seed + i);
+
+            PayloadHeader h = {};
+            h.size = static_cast<uint32_t>(size_);
+            h.crc = Crc32c(&p[kMinSize], size_ - kMinSize);
+            memcpy(&p[0], &h, sizeof h);
+            ring_.emplace_back(std::move(p));
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    std::string& Next() {
+        auto& p = ring_[next_];
+        next_ = (next_ + 1) % ring_.size();
+        return p;
+    }
+
+    // n is what came back, expected what was sent
+    static PayloadVerdict Verify(const char *data, size_t n, size_t expected) {
+        if (n < expected || n < kMinSize) {
+            return PayloadVerdict::kTruncated;
+        }
+
+        PayloadHeader h;
+        memcpy(&h, data, sizeof h);
+        if (h.size != n || n != expected) {
+            return PayloadVerdict::kCorrupt;
+        }
+
+        return Crc32c(data + kMinSize, n - kMinSize) == h.crc
+            ? PayloadVerdict::kOk
+            : PayloadVerdict::kCorrupt;
+    }
+
+private:
+    // xorshift64*, eight bytes per step
+    static void Fill(char *p, size_t n, uint64_t seed) {
+        uint64_t x = seed * 0x9e3779b97f4a7c15ull + 1;
+        while (n > 0) {
+            x ^= x >> 12;
+            x ^= x << 25;
+            x ^= x >> 27;
+            uint64_t v = x * 0x2545f4914f6cdd1dull;
+            size_t k = std::min(n, sizeof v);
+            memcpy(p, &v, k);
+            p += k;
+            n -= k;
+        }
+    }
+
+    size_t size_;
+    size_t next_ = 0;
+    std::vector<std::string> ring_;
+};
+}
+
+#endif // !_PAYLOAD_H_INCLUDED
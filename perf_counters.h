@@ -0,0 +1,182 @@
+#ifndef _PERF_COUNTERS_H_INCLUDED
+#define _PERF_COUNTERS_H_INCLUDED
+
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace testing {
+// per thread counters from perf_event_open(2). Every event is opened on its
+// own so a missing PMU (VMs, containers, perf_event_paranoid) only drops the
+// hardware events, the software ones (task clock, context switches, cpu
+// migrations) keep counting. On other platforms nothing is counted.
+class PerfCounters {
+public:
+    enum Event {
+        kCycles,
+        kInstructions,
+        kCacheMisses,
+        kTaskClock,
+        kContextSwitches,
+        kCpuMigrations,
+        kEventCount
+    };
+
+    PerfCounters() = default;
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    ~PerfCounters() {
+        Close();
+    }
+
+    static const char *name(Event e) {
+        static const char *const kNames[kEventCount] = {
+            "cycles", "instructions", "cache-misses",
+            "task-clock(ns)", "context-switches", "cpu-migrations"
+        };
+        return kNames[e];
+    }
+
+    // opens the counters for the calling thread, returns false if none could be
+    bool Open() {
+        bool any = false;
+#ifdef __linux__
+        static const struct { uint32_t type; uint64_t config; } kEvents[kEventCount] = {
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+            { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+            { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS },
+        };
+
+        for (int i = 0; i < kEventCount; ++i) {
+            // the syscalls are most of the work, so count the kernel side
+            // too unless perf_event_paranoid forbids it
+            fds_[i] = OpenEvent(kEvents[i].type, kEvents[i].config, false);
+            if (fds_[i] < 0) {
+                fds_[i] = OpenEvent(kEvents[i].type, kEvents[i].config, true);
+            }
+
+            any = any || fds_[i] >= 0;
+        }
+#endif
+        return any;
+    }
+
+    void Close() {
+#ifdef __linux__
+        for (auto& fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+#endif
+    }
+
+    bool available(Event e) const {
+        return fds_[e] >= 0;
+    }
+
+    bool hardware() const {
+        return available(kCycles) || available(kInstructions) || available(kCacheMisses);
+    }
+
+    void Start() {
+#ifdef __linux__
+        for (int fd : fds_) {
+            if (fd >= 0) {
+                ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+#endif
+    }
+
+    // stops counting and latches the values, scaled up when the kernel had
+    // to multiplex more events than the PMU has counters
+    void Stop() {
+#ifdef __linux__
+        for (int i = 0; i < kEventCount; ++i) {
+            if (fds_[i] < 0) {
+                continue;
+            }
+
+            ioctl(fds_[i], PERF_EVENT_IOC_DISABLE, 0);
+
+            uint64_t v[3] = {};
+            if (read(fds_[i], v, sizeof v) != sizeof v) {
+                continue;
+            }
+
+            values_[i] = (v[2] > 0 && v[2] < v[1])
+                ? static_cast<uint64_t>(static_cast<double>(v[0]) * v[1] / v[2])
+                : v[0];
+        }
+#endif
+    }
+
+    uint64_t value(Event e) const {
+        return values_[e];
+    }
+
+    // one line per worker: totals and per packet costs of every open counter
+    std::string Report(const std::string& who, uint64_t packets) const {
+        std::ostringstream out;
+        out << who << " perf: packets " << packets;
+        if (!hardware()) {
+            out << " (no hardware counters)";
+        }
+
+        out << std::fixed << std::setprecision(2);
+        for (int i = 0; i < kEventCount; ++i) {
+            if (!available(static_cast<Event>(i))) {
+                continue;
+            }
+
+            out << ", " << name(static_cast<Event>(i)) << ' ' << values_[i];
+            if (packets > 0) {
+                out << " (" << static_cast<double>(values_[i]) / packets << "/pkt)";
+            }
+        }
+
+        if (available(kCycles) && available(kInstructions) && values_[kCycles] > 0) {
+            out << ", ipc " << static_cast<double>(values_[kInstructions]) / values_[kCycles];
+        }
+
+        return out.str();
+    }
+
+private:
+#ifdef __linux__
+    static int OpenEvent(uint32_t type, uint64_t config, bool exclude_kernel) {
+        perf_event_attr attr = {};
+        attr.size = sizeof attr;
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = exclude_kernel ? 1 : 0;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        // pid 0, cpu -1: the calling thread on whatever cpu it runs
+        return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+#endif
+
+    int fds_[kEventCount] = { -1, -1, -1, -1, -1, -1 };
+    uint64_t values_[kEventCount] = {};
+};
+}
+
+#endif // !_PERF_COUNTERS_H_INCLUDED
@@ -0,0 +1,192 @@
+#include "socket.h"
+#include "flags.h"
+#include "stats.h"
+#include "server.h"
+
+#include <functional>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+DEFINE_int(count, 10000000, "messages per variant");
+DEFINE_int(peers, 1024, "distinct ipv4 peers the messages cycle through");
+DEFINE_int(ratelimit, 0, "put a rate limit stage with this rate first, 0 none");
+DEFINE_int(size, 64, "message size");
+
+namespace {
+using namespace testing;
+
+// everything but the syscalls: the messages come from memory and the
+// echo only touches the buffer, so what is left is the per message path
+uint64_t g_sink = 0;
+
+struct NullTransport {
+    using Peer = SocketAddress;
+
+    static int Reply(Socket&, ConstBuffer buf, const Peer&) {
+        g_sink += static_cast<unsigned char>(buf.first[0]) + buf.second;
+        return static_cast<int>(buf.second);
+    }
+};
+
+using NullMessage = Message<NullTransport, CountingStats>;
+
+// every message must really run, not be folded into a closed form
+inline void Clobber() {
+#ifdef __GNUC__
+    asm volatile("" ::: "memory");
+#endif
+}
+
+uint64_t Ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return NowNanos();
+#endif
+}
+
+// the hand written way: every feature is a pointer or flag tested per
+// message
+class PointerHandler {
+public:
+    PointerHandler(PeerRateLimiter *limiter, CaptureWriter *capture, bool quiet)
+        : limiter_(limiter)
+        , capture_(capture)
+        , quiet_(quiet) {}
+
+    void OnMessage(Socket& s, MutableBuffer buf, const SocketAddress& peer, CountingStats& stats) {
+        if (limiter_ && AF_INET == peer.af() && !limiter_->Allow(*peer.v4(), NowNanos())) {
+            stats.OnShed();
+            return;
+        }
+
+        stats.OnPacket(buf.second);
+        if (capture_) {
+            capture_->Write(SOCK_DGRAM, peer, buf);
+        }
+
+        if (!quiet_) {
+            std::clog << "got a msg from " << peer.ToString() << std::endl;
+        }
+
+        NullTransport::Reply(s, buf, peer);
+    }
+
+private:
+    PeerRateLimiter *limiter_;
+    CaptureWriter *capture_;
+    bool quiet_;
+};
+
+// the same stages composed at run time
+using DynamicStage = std::function<bool(NullMessage&)>;
+
+struct Result {
+    double ns;
+    double ticks;
+    uint64_t packets;
+};
+
+template<typename OnMessage>
+Result Run(const std::vector<SocketAddress>& peers, OnMessage&& on_message) {
+    Socket s;
+    std::string payload(std::max(FLAG_size, 1), 'x');
+    CountingStats stats;
+
+    uint64_t t0 = NowNanos();
+    uint64_t c0 = Ticks();
+    for (int i = 0; i < FLAG_count; ++i) {
+        on_message(s, MakeBuffer(payload), peers[i % peers.size()], stats);
+        Clobber();
+    }
+    uint64_t c1 = Ticks();
+    uint64_t t1 = NowNanos();
+
+    return { double(t1 - t0) / FLAG_count, double(c1 - c0) / FLAG_count, stats.packets };
+}
+
+void Print(const char *name, const Result& r) {
+    std::cout << std::setw(12) << name
+              << std::fixed << std::setprecision(2)
+              << std::setw(12) << r.ns
+              << std::setw(12) << r.ticks
+              << std::setw(12) << r.packets << std::endl;
+}
+}
+
+int main(int argc, char *argv[]) {
+    if (!FlagList::ParseCommandLine(argc, argv)) {
+        FlagList::Print(std::cerr);
+        return -1;
+    }
+
+    std::vector<SocketAddress> peers(std::max(FLAG_peers, 1));
+    for (size_t i = 0; i < peers.size(); ++i) {
+        peers[i] = MakeAddress4(static_cast<uint16_t>(1024 + i % 50000), "10.0.0.1");
+        peers[i].v4()->sin_addr.s_addr = htonl(0x0a000000 + static_cast<uint32_t>(i / 50000));
+    }
+
+    // one limiter per variant so each starts with full buckets
+    auto limiter = [] {
+        return FLAG_ratelimit > 0
+            ? std::make_unique<PeerRateLimiter>(FLAG_ratelimit, 64, 65536)
+            : nullptr;
+    };
+
+    std::cout << std::setw(12) << "handler"
+              << std::setw(12) << "ns/msg"
+#if defined(__x86_64__) || defined(__i386__)
+              << std::setw(12) << "tsc/msg"
+#else
+              << std::setw(12) << "ns/msg"
+#endif
+              << std::setw(12) << "echoed" << std::endl;
+
+    {
+        auto l = limiter();
+        PointerHandler h(l.get(), nullptr, true);
+        Print("pointer", Run(peers, [&](Socket& s, MutableBuffer buf, const SocketAddress& peer, CountingStats& stats) {
+            h.OnMessage(s, buf, peer, stats);
+        }));
+    }
+
+    {
+        auto l = limiter();
+        std::vector<DynamicStage> stages;
+        if (l) {
+            stages.emplace_back(RateLimitStage{ l.get() });
+        }
+        stages.emplace_back(CountStage());
+        stages.emplace_back(EchoStage());
+
+        Print("function", Run(peers, [&](Socket& s, MutableBuffer buf, const SocketAddress& peer, CountingStats& stats) {
+            NullMessage m{ s, buf, peer, stats };
+            for (auto&& stage : stages) {
+                if (!stage(m)) {
+                    break;
+                }
+            }
+        }));
+    }
+
+    {
+        auto l = limiter();
+        auto run = [&](auto ... stages) {
+            Pipeline<decltype(stages)..., EchoStage> pipeline(stages..., EchoStage());
+            return Run(peers, [&](Socket& s, MutableBuffer buf, const SocketAddress& peer, CountingStats& stats) {
+                NullMessage m{ s, buf, peer, stats };
+                pipeline(m);
+            });
+        };
+
+        Print("template", l ? run(RateLimitStage{ l.get() }, CountStage()) : run(CountStage()));
+    }
+
+    // keeps the echo from being optimized away
+    return 0 == g_sink ? 1 : 0;
+}
@@ -0,0 +1,98 @@
+#ifndef _PROCFS_H_INCLUDED
+#define _PROCFS_H_INCLUDED
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+namespace testing {
+// utime + stime of a process in seconds, < 0 if it cannot be read
+inline double ProcessCpuSeconds(int pid) {
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string line;
+    if (!std::getline(in, line)) {
+        return -1;
+    }
+
+    // comm may contain spaces, so fields are counted from the last ')',
+    // the first one after it is the state (field 3), utime is field 14
+    auto pos = line.rfind(')');
+    if (std::string::npos == pos) {
+        return -1;
+    }
+
+    std::istringstream fields(line.substr(pos + 1));
+    std::string skip;
+    for (int i = 3; i < 14; ++i) {
+        fields >> skip;
+    }
+
+    unsigned long long utime = 0, stime = 0;
+    if (!(fields >> utime >> stime)) {
+        return -1;
+    }
+
+    return static_cast<double>(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+struct ProcessSample {
+    long rss_kb = -1;
+    int threads = -1;
+    int fds = -1;
+};
+
+// resident set size and thread count from /proc/<pid>/status, open
+// descriptors by listing /proc/<pid>/fd, fields stay -1 when unreadable
+inline ProcessSample SampleProcess(int pid) {
+    ProcessSample sample;
+    std::string dir = "/proc/" + std::to_string(pid);
+
+    std::ifstream in(dir + "/status");
+    std::string line;
+    while (std::getline(in, line)) {
+        if (0 == line.compare(0, 6, "VmRSS:")) {
+            sample.rss_kb = strtol(line.c_str() + 6, nullptr, 10);
+        } else if (0 == line.compare(0, 8, "Threads:")) {
+            sample.threads = static_cast<int>(strtol(line.c_str() + 8, nullptr, 10));
+        }
+    }
+
+    if (DIR *d = opendir((dir + "/fd").c_str())) {
+        sample.fds = 0;
+        while (dirent *e = readdir(d)) {
+            if ('.' != e->d_name[0]) {
+                ++sample.fds;
+            }
+        }
+
+        closedir(d);
+    }
+
+    return sample;
+}
+
+// lifts the soft RLIMIT_NOFILE to the hard one, returns the new soft limit
+inline long RaiseOpenFileLimit() {
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0) {
+        return -1;
+    }
+
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    return static_cast<long>(rl.rlim_cur);
+}
+}
+#endif
+
+#endif // !_PROCFS_H_INCLUDED
@@ -0,0 +1,127 @@
+#ifndef _RATE_LIMITER_H_INCLUDED
+#define _RATE_LIMITER_H_INCLUDED
+
+#include "socket.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace testing {
+// per peer token buckets in a fixed open addressing table shared by all the
+// workers of a process, no locks and no allocation after construction.
+//
+// Each bucket is one word in GCRA form: the theoretical arrival time of the
+// next datagram. A datagram is allowed while that time is at most burst
+// intervals ahead of now, and pushes it one interval further; an idle peer
+// falls behind now and gets its whole burst back, like a refilled bucket.
+//
+// A peer probes kProbes slots from its hash. When they are all taken the
+// one with the oldest arrival time, the longest idle, is evicted. Races only
+// blur the accounting of a single datagram and never block a reader.
+class PeerRateLimiter {
+public:
+    static constexpr size_t kProbes = 8;
+
+    // rate datagrams/s per peer, slots rounded up to a power of two
+    PeerRateLimiter(uint64_t rate, uint64_t burst, size_t slots) {
+        while ((size_t(1) << bits_) < std::max(slots, kProbes)) {
+            ++bits_;
+        }
+
+        mask_ = (size_t(1) << bits_) - 1;
+        slots_.reset(new Slot[mask_ + 1]);
+        interval_ = 1000000000 / std::max<uint64_t>(rate, 1);
+        limit_ = interval_ * std::max<uint64_t>(burst, 1);
+    }
+
+    PeerRateLimiter(const PeerRateLimiter&) = delete;
+    PeerRateLimiter& operator=(const PeerRateLimiter&) = delete;
+
+    // false when the peer is over its rate and the datagram should be dropped
+    bool Allow(const SocketAddress4& peer, uint64_t now_ns) {
+        Slot *s = Lookup(Key(peer));
+        if (!s) {
+            return true;
+        }
+
+        uint64_t tat = s->tat.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t next = std::max(tat, now_ns) + interval_;
+            if (next - now_ns > limit_) {
+                return false;
+            }
+
+            if (s->tat.compare_exchange_weak(tat, next, std::memory_order_relaxed)) {
+                return true;
+            }
+        }
+    }
+
+    size_t slots() const {
+        return mask_ + 1;
+    }
+
+    uint64_t evictions() const {
+        return evictions_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(16) Slot {
+        std::atomic<uint64_t> key{ 0 };
+        std::atomic<uint64_t> tat{ 0 };
+    };
+
+    // address and port in network order plus a tag bit, 0 is an empty slot
+    static uint64_t Key(const SocketAddress4& peer) {
+        return (uint64_t(1) << 48)
+            | (uint64_t(peer.sin_addr.s_addr) << 16)
+            | peer.sin_port;
+    }
+
+    Slot *Lookup(uint64_t key) {
+        size_t i = static_cast<size_t>((key * 0x9e3779b97f4a7c15ull) >> (64 - bits_));
+        Slot *victim = nullptr;
+        uint64_t victim_key = 0;
+        uint64_t oldest = UINT64_MAX;
+
+        for (size_t probe = 0; probe < kProbes; ++probe, i = (i + 1) & mask_) {
+            Slot& s = slots_[i];
+            uint64_t k = s.key.load(std::memory_order_acquire);
+            if (0 == k && s.key.compare_exchange_strong(k, key, std::memory_order_acq_rel)) {
+                return &s;
+            }
+
+            if (k == key) {
+                return &s;
+            }
+
+            uint64_t tat = s.tat.load(std::memory_order_relaxed);
+            if (tat < oldest) {
+                oldest = tat;
+                victim = &s;
+                victim_key = k;
+            }
+        }
+
+        if (!victim->key.compare_exchange_strong(victim_key, key, std::memory_order_acq_rel)) {
+            // someone else took the slot first, let this one datagram through
+            return victim_key == key ? victim : nullptr;
+        }
+
+        victim->tat.store(0, std::memory_order_relaxed);
+        evictions_.fetch_add(1, std::memory_order_relaxed);
+        return victim;
+    }
+
+    int bits_ = 0;
+    size_t mask_ = 0;
+    uint64_t interval_ = 0;
+    uint64_t limit_ = 0;
+    std::unique_ptr<Slot[]> slots_;
+    std::atomic<uint64_t> evictions_{ 0 };
+};
+}
+
+#endif // !_RATE_LIMITER_H_INCLUDED
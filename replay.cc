@@ -0,0 +1,207 @@
+#include "socket.h"
+#include "flags.h"
+#include "stats.h"
+#include "capture.h"
+
+#include <algorithm>
+#include <atomic>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+DEFINE_string(file, "", "capture file written by udp_server/tcp_server -capture");
+DEFINE_int(dstport, 1234, "server port to replay against");
+DEFINE_string(dstip, "127.0.0.1", "server ip to replay against");
+DEFINE_int(speed, 1, "1 original timing, N times faster, 0 as fast as possible");
+DEFINE_int(thread, 1, "replay threads, each captured peer sticks to one thread");
+DEFINE_int(sockets, 64, "sockets per thread, captured peers are spread over them");
+
+namespace {
+using namespace testing;
+
+struct Item {
+    size_t offset;
+    uint32_t slot;
+};
+
+struct Totals {
+    std::atomic<uint64_t> records = 0;
+    std::atomic<uint64_t> sent = 0;
+    std::atomic<uint64_t> received = 0;
+    std::atomic<uint64_t> errors = 0;
+};
+
+uint64_t HashPeer(const char *p, size_t n) {
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < n; ++i) {
+        h = (h ^ static_cast<unsigned char>(p[i])) * 1099511628211ull;
+    }
+
+    return h;
+}
+
+// echoes are only counted, reading them keeps the server from pausing us
+uint64_t Drain(Socket& s) {
+    char xxx[64 * 1024];
+    uint64_t total = 0;
+    int n;
+    while ((n = s.Recv(MakeBuffer(xxx), MSG_DONTWAIT)) > 0) {
+        total += n;
+    }
+
+    return total;
+}
+
+bool SendAll(Socket& s, ConstBuffer buf, Totals& totals) {
+    while (true) {
+        int n = s.Send(buf, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n >= 0 && static_cast<size_t>(n) == buf.second) {
+            totals.sent += buf.second;
+            return true;
+        }
+
+        if (n > 0) {
+            totals.sent += n;
+            buf.first += n;
+            buf.second -= n;
+            continue;
+        }
+
+        if (EAGAIN != errno && EWOULDBLOCK != errno) {
+            return false;
+        }
+
+        if (s.Poll(POLLOUT | POLLIN) & POLLIN) {
+            totals.received += Drain(s);
+        }
+    }
+}
+
+void ReplayThread(const CaptureReader& reader,
+                  const std::vector<Item>& items,
+                  uint64_t base_ns,
+                  uint64_t start_ns,
+                  Totals& totals) {
+    std::vector<Socket> sockets(std::max(FLAG_sockets, 1));
+    auto dst = MakeAddress4(FLAG_dstport, FLAG_dstip);
+
+    for (const auto& item : items) {
+        size_t offset = item.offset;
+        CaptureRecord record;
+        reader.Next(&offset, &record);
+
+        auto& s = sockets[item.slot];
+        try {
+            if (!s) {
+                s = CreateSocket(record.header.type);
+                s.Connect(dst);
+            }
+        } catch (const SocketException& e) {
+            std::cerr << e.what() << '\t' << e.error_code().message() << std::endl;
+            ++totals.errors;
+            return;
+        }
+
+        if (FLAG_speed > 0) {
+            // records may be out of order, the earlier ones go out right away
+            uint64_t offset_ns = record.header.timestamp_ns > base_ns ? record.header.timestamp_ns - base_ns : 0;
+            SleepUntil(start_ns + offset_ns / FLAG_speed);
+        }
+
+        if (!SendAll(s, { record.payload, record.header.size }, totals)) {
+            ++totals.errors;
+            continue;
+        }
+
+        ++totals.records;
+        totals.received += Drain(s);
+    }
+
+    // give the tail of the echoes a moment before counting them
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    for (auto&& s : sockets) {
+        if (s) {
+            totals.received += Drain(s);
+        }
+    }
+}
+}
+
+int main(int argc, char *argv[]) {
+    if (!FlagList::ParseCommandLine(argc, argv)) {
+        FlagList::Print(std::cerr);
+        return -1;
+    }
+
+    if (!*FLAG_file) {
+        std::cerr << "missing -file" << std::endl;
+        return -1;
+    }
+
+    CaptureReader reader;
+    int threads = std::max(FLAG_thread, 1);
+    std::vector<std::vector<Item>> items(threads);
+    // a capture appended to after a reboot, or written by racing workers,
+    // is not sorted by time, so the span runs from the earliest to the latest
+    uint64_t base_ns = UINT64_MAX;
+    uint64_t last_ns = 0;
+
+    try {
+        reader.Open(FLAG_file);
+
+        // every captured peer goes to one thread and one of its sockets, so
+        // each flow is replayed in order on a single connection
+        std::vector<std::unordered_map<uint64_t, uint32_t>> slots(threads);
+        size_t offset = reader.begin();
+        size_t at = offset;
+        CaptureRecord record;
+        while (reader.Next(&offset, &record)) {
+            uint64_t h = HashPeer(record.addr, record.header.addrlen);
+            int t = static_cast<int>(h % threads);
+            auto it = slots[t].emplace(h, static_cast<uint32_t>(slots[t].size() % std::max(FLAG_sockets, 1))).first;
+            items[t].push_back({ at, it->second });
+
+            base_ns = std::min(base_ns, record.header.timestamp_ns);
+            last_ns = std::max(last_ns, record.header.timestamp_ns);
+            at = offset;
+        }
+    } catch (const SocketException& e) {
+        std::cerr << e.what() << '\t' << e.error_code().message() << std::endl;
+        return -1;
+    }
+
+    if (last_ns < base_ns) {
+        base_ns = last_ns = 0;
+    }
+
+    Totals totals;
+    uint64_t start_ns = NowNanos();
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&, t] {
+            ReplayThread(reader, items[t], base_ns, start_ns, totals);
+        });
+    }
+
+    for (auto&& w : workers) {
+        w.join();
+    }
+
+    double secs = (NowNanos() - start_ns) / 1e9;
+    double captured = (last_ns - base_ns) / 1e9;
+    std::cout << std::fixed << std::setprecision(3)
+              << "replayed " << totals.records << " records, "
+              << totals.sent / 1048576.0 << " MB in " << secs << " s"
+              << " (captured span " << captured << " s)" << std::endl
+              << std::setprecision(0)
+              << totals.records / secs << " records/s, "
+              << std::setprecision(1)
+              << totals.sent / 1048576.0 / secs << " MB/s, "
+              << "echoed " << totals.received / 1048576.0 << " MB, "
+              << totals.errors << " errors" << std::endl;
+    return 0;
+}
@@ -0,0 +1,107 @@
+#ifndef _SEND_QUEUE_H_INCLUDED
+#define _SEND_QUEUE_H_INCLUDED
+
+#include "socket.h"
+
+#include <deque>
+#include <string>
+
+namespace testing {
+// per connection output queue. Small responses are coalesced into chunks
+// and the whole backlog goes out in one vectored send, the watermarks tell
+// the owner to stop reading from a peer that does not drain its replies.
+class SendQueue {
+public:
+    static constexpr size_t kChunkSize = 16 * 1024;
+
+    SendQueue(size_t high_watermark, size_t low_watermark)
+        : high_(high_watermark)
+        , low_(std::min(low_watermark, high_watermark)) {}
+
+    bool empty() const {
+        return 0 == bytes_;
+    }
+
+    size_t bytes() const {
+        return bytes_;
+    }
+
+    // set once the backlog reaches the high watermark, cleared only after
+    // it drains below the low one
+    bool paused() const {
+        return paused_;
+    }
+
+    void Push(ConstBuffer buf) {
+        while (buf.second > 0) {
+            if (chunks_.empty() || chunks_.back().size() >= kChunkSize) {
+                chunks_.emplace_back();
+                chunks_.back().reserve(kChunkSize);
+            }
+
+            auto& tail = chunks_.back();
+            size_t n = std::min(buf.second, kChunkSize - tail.size());
+            tail.append(buf.first, n);
+            buf.first += n;
+            buf.second -= n;
+            bytes_ += n;
+        }
+
+        if (bytes_ >= high_) {
+            paused_ = true;
+        }
+    }
+
+    // one gathered send of the queued chunks, returns the bytes sent or the
+    // result of the failed send
+    int Flush(Socket& socket, int flags = 0) {
+        ConstBuffer bufs[Socket::kMaxSendBuffers];
+        size_t count = 0;
+        size_t offset = offset_;
+        for (auto it = chunks_.begin(); it != chunks_.end() && count < Socket::kMaxSendBuffers; ++it) {
+            bufs[count++] = { it->data() + offset, it->size() - offset };
+            offset = 0;
+        }
+
+        if (0 == count) {
+            return 0;
+        }
+
+        int n = socket.Send(bufs, count, flags);
+        if (n > 0) {
+            Consume(n);
+        }
+
+        return n;
+    }
+
+private:
+    void Consume(size_t n) {
+        bytes_ -= n;
+        while (n > 0) {
+            size_t left = chunks_.front().size() - offset_;
+            if (n < left) {
+                offset_ += n;
+                break;
+            }
+
+            n -= left;
+            offset_ = 0;
+            chunks_.pop_front();
+        }
+
+        if (bytes_ <= low_) {
+            paused_ = false;
+        }
+    }
+
+    std::deque<std::string> chunks_;
+    size_t offset_ = 0;
+    size_t bytes_ = 0;
+    size_t high_;
+    size_t low_;
+    bool paused_ = false;
+};
+}
+
+#endif // !_SEND_QUEUE_H_INCLUDED
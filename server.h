@@ -0,0 +1,605 @@
+#ifndef _SERVER_H_INCLUDED
+#define _SERVER_H_INCLUDED
+
+#include "socket.h"
+#include "stats.h"
+#include "capture.h"
+#include "rate_limiter.h"
+#include "perf_counters.h"
+
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+#endif
+
+namespace testing {
+// Server<Transport, Engine, Handler, Stats> serves one socket on one thread:
+// the Transport reads and answers a message, the Engine decides how the
+// thread waits for the next one, the Handler is the per message pipeline
+// and Stats counts. All four are plain types, so the per packet path has
+// no std::function or virtual call and inlines into the engine loop.
+//
+// An engine hands each message to on_message(TransportTag<T>(), socket,
+// buf, peer), T being the transport that answers it, and learns from the
+// result whether the pipeline kept it. Engines that serve more than one
+// socket, like FlowEngine, pass a different tag per socket.
+
+template<typename T>
+struct TransportTag {
+    using type = T;
+};
+
+// unconnected datagram socket, every message brings its own peer
+struct DatagramTransport {
+    using Peer = SocketAddress;
+
+    static int Recv(Socket& s, MutableBuffer buf, Peer& peer, int flags) {
+        return s.RecvFrom(buf, peer, flags);
+    }
+
+    static int Reply(Socket& s, ConstBuffer buf, const Peer& peer) {
+        return s.SendTo(buf, peer);
+    }
+};
+
+#ifndef _WIN32
+// connected stream or datagram socket, the peer is fixed when it is created
+struct ConnectedTransport {
+    using Peer = SocketAddress;
+
+    static int Recv(Socket& s, MutableBuffer buf, Peer&, int flags) {
+        return s.Recv(buf, flags);
+    }
+
+    static int Reply(Socket& s, ConstBuffer buf, const Peer&) {
+        return s.Send(buf, MSG_NOSIGNAL);
+    }
+};
+#endif
+
+struct BlockingEngine {
+    template<typename Transport, typename OnMessage>
+    void Run(Socket& s, typename Transport::Peer& peer, OnMessage&& on_message) {
+        char xxx[1024];
+
+        while (true) {
+            auto buf = MakeBuffer(xxx);
+            int n = Transport::Recv(s, buf, peer, 0);
+            if (n <= 0) {
+                break;
+            }
+
+            buf.second = n;
+            on_message(TransportTag<Transport>(), s, buf, peer);
+        }
+    }
+};
+
+#ifdef __linux__
+// spins on non-blocking reads with a budget that doubles while spinning
+// finds messages and halves when it runs dry, then blocks in poll
+struct BusyPollEngine {
+    static constexpr int kMinSpins = 16;
+
+    int busy_poll_us;
+    int max_spins;
+
+    template<typename Transport, typename OnMessage>
+    void Run(Socket& s, typename Transport::Peer& peer, OnMessage&& on_message) {
+        // both may be refused (CAP_NET_ADMIN, kernels before 5.11), user
+        // space spinning still pays off
+        std::error_code ec;
+        s.SetOpt(ec, BusyPollSockOpt(busy_poll_us));
+        s.SetOpt(ec, PreferBusyPollSockOpt(true));
+
+        char xxx[1024];
+        int spin_limit = kMinSpins;
+        int spin_max = std::max(max_spins, kMinSpins);
+
+        while (true) {
+            auto buf = MakeBuffer(xxx);
+            int n;
+            int spins = 0;
+            while ((n = Transport::Recv(s, buf, peer, MSG_DONTWAIT)) < 0
+                   && (EAGAIN == errno || EWOULDBLOCK == errno)
+                   && spins < spin_limit) {
+                ++spins;
+            }
+
+            if (n > 0) {
+                if (spins > 0) {
+                    spin_limit = std::min(spin_limit * 2, spin_max);
+                }
+
+                buf.second = n;
+                on_message(TransportTag<Transport>(), s, buf, peer);
+                continue;
+            }
+
+            if (0 == n || (EAGAIN != errno && EWOULDBLOCK != errno)) {
+                break;
+            }
+
+            // only poll reports a socket shut down by Stop
+            spin_limit = std::max(spin_limit / 2, kMinSpins);
+            int revents = s.Poll(POLLIN | POLLRDHUP);
+            if ((revents < 0 && EINTR != errno)
+                || (revents > 0 && (revents & (POLLRDHUP | POLLERR | POLLNVAL)))) {
+                break;
+            }
+        }
+    }
+};
+
+// gives up to max_flows ipv4 peers their own socket, bound to the local
+// address with SO_REUSEPORT and connected to the peer, which the kernel
+// prefers over the wildcard sockets for that 4-tuple. The wildcard socket
+// only answers the first datagrams of a peer and opens its flow, from then
+// on the kernel demultiplexes and replies are plain sends without an
+// address. epoll hands over the ready socket itself, the peer map is only
+// used on the wildcard path. Peers past max_flows stay on the wildcard
+// socket. A flow without traffic for idle_ms is closed and its peer goes
+// back to the wildcard socket, so quiet peers do not hold on to the table.
+struct FlowEngine {
+    SocketAddress local;
+    size_t max_flows;
+    bool reuseaddr;
+    int idle_ms;  // 0 keeps flows until recv fails
+
+    // left for Summary when Run returns
+    size_t connected = 0;
+    size_t refused = 0;
+    size_t expired = 0;
+
+    template<typename Transport, typename OnMessage>
+    void Run(Socket& s, typename Transport::Peer& peer, OnMessage&& on_message) {
+        FlowTable t;
+        t.ep = epoll_create1(EPOLL_CLOEXEC);
+        if (t.ep < 0) {
+            CheckAndThrowIfERR("epoll_create1");
+        }
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = kListenerToken;
+        epoll_ctl(t.ep, EPOLL_CTL_ADD, s.native_handle(), &ev);
+
+        epoll_event events[64];
+        char xxx[1024];
+        bool stop = false;
+
+        while (!stop) {
+            int n = epoll_wait(t.ep, events, 64, SweepTimeout(t));
+            if (n < 0 && EINTR == errno) {
+                continue;
+            }
+
+            if (n < 0) {
+                break;
+            }
+
+            // one clock read per wakeup stamps every flow read in it
+            if (idle_ms > 0) {
+                t.now_ns = NowNanos();
+            }
+
+            for (int i = 0; i < n; ++i) {
+                if (kListenerToken != events[i].data.u64) {
+                    ReadFlow(t, events[i].data.u64, on_message, xxx, sizeof xxx);
+                    continue;
+                }
+
+                // non-blocking reads keep failing with EAGAIN after Stop
+                if (events[i].events & EPOLLRDHUP) {
+                    stop = true;
+                    break;
+                }
+
+                auto buf = MakeBuffer(xxx);
+                int r;
+                while ((r = Transport::Recv(s, buf, peer, MSG_DONTWAIT)) >= 0) {
+                    buf.second = r;
+                    if (on_message(TransportTag<Transport>(), s, buf, peer)
+                        && AF_INET == peer.af()
+                        && t.peers.size() < max_flows
+                        && !t.peers.count(FlowKey(peer))
+                        && MayOpen(t)) {
+                        OpenFlow(t, peer, on_message, xxx, sizeof xxx);
+                    }
+
+                    buf = MakeBuffer(xxx);
+                }
+            }
+
+            if (idle_ms > 0 && t.now_ns >= t.sweep_ns) {
+                Sweep(t);
+            }
+        }
+
+        connected = t.peers.size();
+    }
+
+    template<typename S>
+    void Summary(std::ostream& out, const S&) const {
+        out << " connected flows " << connected;
+        if (expired) {
+            out << " expired " << expired;
+        }
+
+        if (refused) {
+            out << " refused " << refused;
+        }
+    }
+
+private:
+    static constexpr uint64_t kListenerToken = UINT64_MAX;
+    static constexpr uint64_t kRefusedBackoffNs = 1000000000;
+
+    struct Flow {
+        Socket socket;
+        SocketAddress peer;
+        uint64_t key;
+        uint64_t last_ns;  // wakeup that brought its last datagram
+    };
+
+    // the epoll set and the flows in it, closed however Run ends
+    struct FlowTable {
+        int ep = -1;
+        std::vector<Flow> flows;
+        std::vector<size_t> free_slots;
+        std::unordered_map<uint64_t, size_t> peers;
+        uint64_t retry_ns = 0;  // no new flows before, set by a refusal
+        uint64_t now_ns = 0;  // of the current wakeup, with idle_ms only
+        uint64_t sweep_ns = 0;  // next look for idle flows
+
+        ~FlowTable() {
+            if (ep >= 0) {
+                close(ep);
+            }
+        }
+    };
+
+    static uint64_t FlowKey(const SocketAddress& peer) {
+        return (uint64_t(peer.v4()->sin_addr.s_addr) << 16) | peer.v4()->sin_port;
+    }
+
+    // a refusal is most likely EMFILE or ENFILE, which every other peer
+    // would run into as well, so the wildcard path stops trying for a while
+    // instead of paying the failing syscalls per datagram
+    static bool MayOpen(FlowTable& t) {
+        if (0 == t.retry_ns) {
+            return true;
+        }
+
+        if (NowNanos() < t.retry_ns) {
+            return false;
+        }
+
+        t.retry_ns = 0;
+        return true;
+    }
+
+    template<typename OnMessage>
+    void OpenFlow(FlowTable& t, const SocketAddress& peer, OnMessage& on_message, char *xxx, size_t size) {
+        Socket s;
+        try {
+            s = CreateSocket(
+                SOCK_DGRAM,
+                WithReuseSocketOpt(reuseaddr, true),
+                WithBind(local),
+                WithConnect(peer));
+        } catch (const SocketException&) {
+            // the peer stays on the wildcard socket
+            ++refused;
+            t.retry_ns = NowNanos() + kRefusedBackoffNs;
+            return;
+        }
+
+        // between bind and connect the socket was an ordinary member of the
+        // reuseport group and may hold datagrams of other peers
+        SocketAddress from;
+        int r;
+        while ((r = s.RecvFrom({ xxx, size }, from, MSG_DONTWAIT)) >= 0) {
+            on_message(TransportTag<DatagramTransport>(), s, MutableBuffer{ xxx, static_cast<size_t>(r) }, from);
+        }
+
+        size_t slot = t.flows.size();
+        if (!t.free_slots.empty()) {
+            slot = t.free_slots.back();
+            t.free_slots.pop_back();
+        } else {
+            t.flows.emplace_back();
+        }
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.u64 = slot;
+        epoll_ctl(t.ep, EPOLL_CTL_ADD, s.native_handle(), &ev);
+
+        t.flows[slot] = { std::move(s), peer, FlowKey(peer), t.now_ns };
+        t.peers.emplace(t.flows[slot].key, slot);
+    }
+
+    template<typename OnMessage>
+    void ReadFlow(FlowTable& t, size_t slot, OnMessage& on_message, char *xxx, size_t size) {
+        auto& flow = t.flows[slot];
+        while (true) {
+            // an empty datagram is still a datagram
+            int r = ConnectedTransport::Recv(flow.socket, { xxx, size }, flow.peer, MSG_DONTWAIT);
+            if (r >= 0) {
+                flow.last_ns = t.now_ns;
+                on_message(TransportTag<ConnectedTransport>(), flow.socket, MutableBuffer{ xxx, static_cast<size_t>(r) }, flow.peer);
+                continue;
+            }
+
+            if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                return;
+            }
+
+            // ECONNREFUSED once the peer's port is closed
+            CloseFlow(t, slot);
+            return;
+        }
+    }
+
+    // the slot is reused, the peer's next datagram reaches a wildcard socket
+    static void CloseFlow(FlowTable& t, size_t slot) {
+        auto& flow = t.flows[slot];
+        epoll_ctl(t.ep, EPOLL_CTL_DEL, flow.socket.native_handle(), nullptr);
+        flow.socket.Close();
+        t.peers.erase(flow.key);
+        t.free_slots.push_back(slot);
+    }
+
+    // idle flows are looked for four times per idle_ms, so one lives at
+    // most a quarter longer than that
+    void Sweep(FlowTable& t) {
+        uint64_t idle_ns = idle_ms * 1000000ull;
+        for (size_t slot = 0; slot < t.flows.size(); ++slot) {
+            if (t.flows[slot].socket && t.now_ns - t.flows[slot].last_ns >= idle_ns) {
+                CloseFlow(t, slot);
+                ++expired;
+            }
+        }
+
+        t.sweep_ns = t.now_ns + idle_ns / 4;
+    }
+
+    // epoll_wait timeout: wake up for the next sweep while there are flows
+    int SweepTimeout(const FlowTable& t) const {
+        if (idle_ms <= 0 || t.peers.empty()) {
+            return -1;
+        }
+
+        return t.sweep_ns > t.now_ns ? static_cast<int>((t.sweep_ns - t.now_ns + 999999) / 1000000) : 0;
+    }
+};
+#endif
+
+// what a pipeline stage sees of one message
+template<typename TransportType, typename StatsType>
+struct Message {
+    using Transport = TransportType;
+
+    Socket& socket;
+    MutableBuffer buf;
+    const typename Transport::Peer& peer;
+    StatsType& stats;
+};
+
+// the minimal Stats, Server reads packets() for its perf report
+struct CountingStats {
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t shed = 0;
+
+    void OnPacket(size_t n) {
+        ++packets;
+        bytes += n;
+    }
+
+    void OnShed() {
+        ++shed;
+    }
+};
+
+// the exit summary hook: an engine, handler or stage with a
+// Summary(std::ostream&, const Stats&) member adds to the line Server prints
+// when its thread exits, the others are skipped at compile time
+template<typename T, typename S>
+auto Summarize(const T& part, std::ostream& out, const S& stats, int) -> decltype(part.Summary(out, stats), void()) {
+    part.Summary(out, stats);
+}
+
+template<typename T, typename S>
+void Summarize(const T&, std::ostream&, const S&, long) {}
+
+// stages run in order and a stage returning false ends the message, the
+// fold over the tuple expands to straight line code. The result tells the
+// engine whether every stage kept the message.
+template<typename ... Stages>
+class Pipeline {
+public:
+    explicit Pipeline(Stages ... stages) : stages_(std::move(stages)...) {}
+
+    template<typename M>
+    bool operator()(M& m) {
+        return std::apply([&m](auto& ... stage) { return (stage(m) && ...); }, stages_);
+    }
+
+    template<typename S>
+    void Summary(std::ostream& out, const S& stats) const {
+        std::apply([&](const auto& ... stage) { (Summarize(stage, out, stats, 0), ...); }, stages_);
+    }
+
+private:
+    std::tuple<Stages...> stages_;
+};
+
+struct RateLimitStage {
+    PeerRateLimiter *limiter;
+
+    template<typename M>
+    bool operator()(M& m) {
+        if (AF_INET == m.peer.af() && !limiter->Allow(*m.peer.v4(), NowNanos())) {
+            m.stats.OnShed();
+            return false;
+        }
+
+        return true;
+    }
+
+    template<typename S>
+    void Summary(std::ostream& out, const S& stats) const {
+        out << " packets " << stats.packets << " shed " << stats.shed
+            << " table evictions " << limiter->evictions();
+    }
+};
+
+struct CountStage {
+    template<typename M>
+    bool operator()(M& m) {
+        m.stats.OnPacket(m.buf.second);
+        return true;
+    }
+};
+
+struct CaptureStage {
+    CaptureWriter *capture;
+    int type;
+
+    template<typename M>
+    bool operator()(M& m) {
+        capture->Write(type, m.peer, m.buf);
+        return true;
+    }
+};
+
+struct LogStage {
+    std::string name;
+
+    template<typename M>
+    bool operator()(M& m) {
+        std::clog << name << " got a msg from " << m.peer.ToString() << std::endl;
+        return true;
+    }
+};
+
+struct EchoStage {
+    template<typename M>
+    bool operator()(M& m) {
+        M::Transport::Reply(m.socket, m.buf, m.peer);
+        return true;
+    }
+};
+
+// calls f with the stages that are present. Every combination is its own
+// instantiation, so run time switches pick a pipeline instead of being
+// tested per message.
+template<typename F, typename ... Chosen>
+auto ChooseStages(F&& f, std::tuple<Chosen...> chosen) {
+    return std::apply(std::forward<F>(f), std::move(chosen));
+}
+
+template<typename F, typename ... Chosen, typename Stage, typename ... Rest>
+auto ChooseStages(F&& f, std::tuple<Chosen...> chosen, std::optional<Stage> stage, std::optional<Rest> ... rest) {
+    if (stage) {
+        return ChooseStages(std::forward<F>(f), std::tuple_cat(std::move(chosen), std::make_tuple(std::move(*stage))), std::move(rest)...);
+    }
+
+    return ChooseStages(std::forward<F>(f), std::move(chosen), std::move(rest)...);
+}
+
+// lets servers with different pipelines share one list, nothing per message
+class ServerBase {
+public:
+    virtual ~ServerBase() = default;
+};
+
+template<typename Transport, typename Engine, typename Handler, typename Stats = CountingStats>
+class Server : public ServerBase {
+public:
+    // the thread captures this, so servers are never moved
+    Server(std::string name,
+           Socket&& socket,
+           const typename Transport::Peer& peer,
+           Engine engine,
+           Handler handler,
+           Stats stats = Stats(),
+           bool perf = false)
+        : name_(std::move(name))
+        , socket_(std::move(socket))
+        , peer_(peer)
+        , engine_(std::move(engine))
+        , handler_(std::move(handler))
+        , stats_(std::move(stats)) {
+        thread_ = std::thread([this, perf] { Run(perf); });
+    }
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    ~Server() override {
+        Stop();
+    }
+
+    void Stop() {
+        std::error_code ec;
+        socket_.Shutdown(ec);
+
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+
+        socket_.Close();
+    }
+
+private:
+    void Run(bool perf) {
+        PerfCounters counters;
+        if (perf) {
+            counters.Open();
+            counters.Start();
+        }
+
+        try {
+            engine_.template Run<Transport>(socket_, peer_, [this](auto transport, Socket& s, MutableBuffer buf, const typename Transport::Peer& peer) {
+                Message<typename decltype(transport)::type, Stats> m{ s, buf, peer, stats_ };
+                return handler_(m);
+            });
+        } catch (...) {}
+
+        if (perf) {
+            counters.Stop();
+            std::clog << counters.Report(name_, stats_.packets) + '\n' << std::flush;
+        }
+
+        std::ostringstream summary;
+        Summarize(engine_, summary, stats_, 0);
+        Summarize(handler_, summary, stats_, 0);
+        if (!summary.str().empty()) {
+            std::clog << name_ + summary.str() + '\n' << std::flush;
+        }
+    }
+
+    std::string name_;
+    Socket socket_;
+    typename Transport::Peer peer_;
+    Engine engine_;
+    Handler handler_;
+    Stats stats_;
+    std::thread thread_;
+};
+}
+
+#endif // !_SERVER_H_INCLUDED
@@ -2,22 +2,31 @@
 #define _SOCKET_H_INCLUDED
 
 #ifdef _WIN32
-    #include <winsock.h>
-    typedef int socklen_t;
+    #include <winsock2.h>
+    #include <ws2tcpip.h>
 #else
     #include <sys/types.h>
     #include <sys/socket.h>
+    #include <sys/un.h>
+    #include <sys/uio.h>
     #include <arpa/inet.h>
+    #include <poll.h>
     #include <unistd.h>
 
     #define GetLastError()    errno
+
+    #ifndef MSG_NOSIGNAL
+    #define MSG_NOSIGNAL 0
+    #endif
 #endif
 
+#include <algorithm>
 #include <cstdint>
 #include <system_error>
 #include <string>
 #include <functional>
 #include <cassert>
+#include <cstddef>
 #include <string.h>
 
 namespace testing {
@@ -68,9 +77,79 @@ struct SocketAddress4 : sockaddr_in {
     }
 };
 
-struct SocketAddress : sockaddr {
+#ifndef _WIN32
+struct SocketAddressUnix : sockaddr_un {
+    int af() const {
+        return this->sun_family;
+    }
+
+    // abstract names start with a NUL byte and are not NUL terminated,
+    // so they are printed with a leading '@' like ss(8) does
+    bool abstract() const {
+        return '\0' == this->sun_path[0];
+    }
+
+    std::string path(socklen_t addrlen) const {
+        if (addrlen <= offsetof(sockaddr_un, sun_path)) {
+            return {};
+        }
+
+        size_t n = addrlen - offsetof(sockaddr_un, sun_path);
+        if (abstract()) {
+            return '@' + std::string(this->sun_path + 1, n - 1);
+        }
+
+        return std::string(this->sun_path, strnlen(this->sun_path, n));
+    }
+
+    // returns the address length, a leading '@' selects the abstract namespace
+    socklen_t path(const char *str) {
+        size_t n = strlen(str);
+        if (n >= sizeof this->sun_path) {
+            n = sizeof this->sun_path - 1;
+        }
+
+        memcpy(this->sun_path, str, n);
+        if ('@' == str[0]) {
+            this->sun_path[0] = '\0';
+            return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + n);
+        }
+
+        this->sun_path[n] = '\0';
+        return static_cast<socklen_t>(offsetof(sockaddr_un, sun_path) + n + 1);
+    }
+};
+#endif
+
+struct SocketAddress : sockaddr_storage {
     SocketAddress() {
         memset(this, 0, sizeof(SocketAddress));
+        len_ = sizeof(sockaddr_storage);
+    }
+
+    int af() const {
+        return this->ss_family;
+    }
+
+    sockaddr *sa() {
+        return reinterpret_cast<sockaddr *>(this);
+    }
+
+    const sockaddr *sa() const {
+        return reinterpret_cast<const sockaddr *>(this);
+    }
+
+    // length of the address actually stored, passed to bind/connect/sendto
+    socklen_t size() const {
+        return len_;
+    }
+
+    void size(socklen_t len) {
+        len_ = len;
+    }
+
+    static constexpr socklen_t capacity() {
+        return sizeof(sockaddr_storage);
     }
 
     SocketAddress4 *v4() {
@@ -80,6 +159,34 @@ struct SocketAddress : sockaddr {
     const SocketAddress4 *v4() const {
         return reinterpret_cast<const SocketAddress4 *>(this);
     }
+
+#ifndef _WIN32
+    SocketAddressUnix *un() {
+        return reinterpret_cast<SocketAddressUnix *>(this);
+    }
+
+    const SocketAddressUnix *un() const {
+        return reinterpret_cast<const SocketAddressUnix *>(this);
+    }
+#endif
+
+    std::string ToString() const {
+        switch (af()) {
+        case AF_INET:
+            return std::string(v4()->ip()) + ',' + std::to_string(v4()->port());
+#ifndef _WIN32
+        case AF_UNIX: {
+            auto path = un()->path(len_);
+            return path.empty() ? "unix:<unnamed>" : "unix:" + path;
+        }
+#endif
+        default:
+            return "af:" + std::to_string(af());
+        }
+    }
+
+private:
+    socklen_t len_;
 };
 
 inline SocketAddress 
@@ -88,9 +195,27 @@ MakeAddress4(uint16_t port, const char *str = "127.0.0.1") {
     a.v4()->sin_family = AF_INET;
     a.v4()->port(port);
     a.v4()->ip(str);
+    a.size(sizeof(sockaddr_in));
+
+    return a;
+}
+
+#ifndef _WIN32
+// "/path/to/sock" for a filesystem socket, "@name" for an abstract one,
+// an empty string only carries the family and autobinds on bind
+inline SocketAddress
+MakeAddressUnix(const char *path) {
+    SocketAddress a;
+    a.un()->sun_family = AF_UNIX;
+    if (!*path) {
+        a.size(sizeof(sa_family_t));
+    } else {
+        a.size(a.un()->path(path));
+    }
 
     return a;
 }
+#endif
 
 #ifdef _WIN32
 template<int Major = 2, int Minor = 0>
@@ -169,6 +294,13 @@ struct BoolSockOpt : SockOpt<Level, Name, int> {
     }
 };
 
+template<int Level, int Name>
+struct IntSockOpt : SockOpt<Level, Name, int> {
+    explicit IntSockOpt(int v = 0) {
+        this->val = v;
+    }
+};
+
 using RcvTimeoutSockOpt = TimeoutSockOpt<SOL_SOCKET, SO_RCVTIMEO>;
 
 using SndTimeoutSockOpt = TimeoutSockOpt<SOL_SOCKET, SO_SNDTIMEO>;
@@ -179,6 +311,22 @@ using ReuseAddrSockOpt = BoolSockOpt<SOL_SOCKET, SO_REUSEADDR>;
 using ReusePortSockOpt = BoolSockOpt<SOL_SOCKET, SO_REUSEPORT>;
 #endif
 
+#ifdef __linux__
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+// usecs the kernel busy polls the device queue on a blocking read
+using BusyPollSockOpt = IntSockOpt<SOL_SOCKET, SO_BUSY_POLL>;
+
+// since linux 5.11, keeps softirq processing off the busy polling thread
+using PreferBusyPollSockOpt = BoolSockOpt<SOL_SOCKET, SO_PREFER_BUSY_POLL>;
+
+// bind(ip, 0) defers picking the port to connect, so every source ip
+// gets the whole ephemeral range per destination
+using BindAddressNoPortSockOpt = BoolSockOpt<IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT>;
+#endif
+
 using MutableBuffer = std::pair<char *, size_t>;
 
 using ConstBuffer = std::pair<const char *, size_t>;
@@ -227,6 +375,14 @@ public:
 
     static constexpr int kListenBacklogDefault = 64;
 
+    static constexpr size_t kMaxSendBuffers = 64;
+
+#ifdef _WIN32
+    static constexpr int kShutdownBoth = SD_BOTH;
+#else
+    static constexpr int kShutdownBoth = SHUT_RDWR;
+#endif
+
     Socket() = default;
     ~Socket() { Close(); }
 
@@ -247,6 +403,11 @@ public:
         return Opened();
     }
 
+    // for calls this wrapper does not cover, the socket keeps ownership
+    RawSocketHandle native_handle() const {
+        return h_;
+    }
+
     RawSocketHandle Detach() {
         RawSocketHandle h = h_;
         h_ = kInvalidSocketHandle;
@@ -265,7 +426,7 @@ public:
 
     void Open(int type = SOCK_STREAM,
               int protocol = 0,
-              int af = AF_INET) noexcept {
+              int af = AF_INET) {
         std::error_code ec;
         Open(ec, type, protocol, af);
         CheckAndThrowIfERR("socket", ec);
@@ -281,8 +442,21 @@ public:
         }
     }
 
+    // wakes up threads blocked in accept/recv on this socket, unlike Close
+    void Shutdown(std::error_code& ec, int how = kShutdownBoth) noexcept {
+        if (shutdown(h_, how) < 0) {
+            ec.assign(GetLastError(), std::system_category());
+        }
+    }
+
+    void Shutdown(int how = kShutdownBoth) {
+        std::error_code ec;
+        Shutdown(ec, how);
+        CheckAndThrowIfERR("shutdown", ec);
+    }
+
     void Bind(std::error_code& ec, const SocketAddress& addr) noexcept {
-        if (bind(h_, &addr, sizeof addr) < 0) {
+        if (bind(h_, addr.sa(), addr.size()) < 0) {
             ec.assign(GetLastError(), std::system_category());
         }
     }
@@ -299,7 +473,7 @@ public:
         }
     }
 
-    void Listen(int backlog = kListenBacklogDefault) noexcept {
+    void Listen(int backlog = kListenBacklogDefault) {
         std::error_code ec;
         Listen(ec, backlog);
         CheckAndThrowIfERR("listen", ec);
@@ -313,19 +487,21 @@ public:
             addr = &taddr;
         }
 
-        socklen_t addrlen = sizeof taddr;
+        socklen_t addrlen = SocketAddress::capacity();
         RawSocketHandle h;
-        h = accept(h_, &taddr, &addrlen);
+        h = accept(h_, addr->sa(), &addrlen);
         if (kInvalidSocketHandle == h) {
             return false;
         }
 
+        addr->size(addrlen);
+        client->Close();
         client->h_ = h;
         return true;
     }
 
     void Connect(std::error_code& ec, const SocketAddress& addr) noexcept {
-        if (connect(h_, &addr, sizeof addr) < 0) {
+        if (connect(h_, addr.sa(), addr.size()) < 0) {
             ec.assign(GetLastError(), std::system_category());
         }
     }
@@ -354,30 +530,72 @@ public:
         CheckAndThrowIfERR("setsockopt", ec);
     }
 
+#ifndef _WIN32
+    // returns the revents, 0 on timeout and -1 on error
+    int Poll(short events, int timeout_ms = -1) noexcept {
+        pollfd pfd = { h_, events, 0 };
+        int n = poll(&pfd, 1, timeout_ms);
+        return n > 0 ? pfd.revents : n;
+    }
+#endif
+
     int Send(ConstBuffer buf, int flags = 0) noexcept {
         return send(h_, buf.first, buf.second, flags);
     }
 
+    // gathers up to kMaxSendBuffers buffers into one syscall, returns the
+    // bytes sent like Send, a partial write is resumed by the caller
+    int Send(const ConstBuffer *bufs, size_t count, int flags = 0) noexcept {
+        count = std::min(count, kMaxSendBuffers);
+#ifdef _WIN32
+        WSABUF wbufs[kMaxSendBuffers];
+        for (size_t i = 0; i < count; ++i) {
+            wbufs[i].buf = const_cast<char *>(bufs[i].first);
+            wbufs[i].len = static_cast<ULONG>(bufs[i].second);
+        }
+
+        DWORD sent = 0;
+        if (0 != WSASend(h_, wbufs, static_cast<DWORD>(count), &sent, flags, nullptr, nullptr)) {
+            return -1;
+        }
+
+        return static_cast<int>(sent);
+#else
+        iovec iov[kMaxSendBuffers];
+        for (size_t i = 0; i < count; ++i) {
+            iov[i].iov_base = const_cast<char *>(bufs[i].first);
+            iov[i].iov_len = bufs[i].second;
+        }
+
+        msghdr msg = {};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        return static_cast<int>(sendmsg(h_, &msg, flags));
+#endif
+    }
+
     int Recv(MutableBuffer buf, int flags = 0) noexcept {
         return recv(h_, buf.first, buf.second, flags);
     }
 
     int SendTo(ConstBuffer buf, const SocketAddress& peer, int flags = 0) noexcept {
-        return sendto(h_, buf.first, buf.second, flags, &peer, sizeof peer);
+        return sendto(h_, buf.first, buf.second, flags, peer.sa(), peer.size());
     }
 
     int RecvFrom(MutableBuffer buf, SocketAddress& peer, int flags = 0) noexcept {
-        socklen_t addrlen = sizeof peer;
-        return recvfrom(h_, buf.first, buf.second, flags, &peer, &addrlen);
+        socklen_t addrlen = SocketAddress::capacity();
+        int n = recvfrom(h_, buf.first, buf.second, flags, peer.sa(), &addrlen);
+        peer.size(addrlen);
+        return n;
     }
 private:
     RawSocketHandle h_ = kInvalidSocketHandle;
 };
 
 template<typename ... CreateOpts>
-Socket CreateSocket(int type, CreateOpts&& ... opts) {
+Socket CreateSocketWithFamily(int af, int type, CreateOpts&& ... opts) {
     Socket socket;
-    socket.Open(type);
+    socket.Open(type, 0, af);
 
     // expression fold since c++17
     (std::forward<CreateOpts>(opts)(socket), ...);
@@ -385,23 +603,37 @@ Socket CreateSocket(int type, CreateOpts&& ... opts) {
     return std::move(socket);
 }
 
+template<typename ... CreateOpts>
+Socket CreateSocket(int type, CreateOpts&& ... opts) {
+    return CreateSocketWithFamily(AF_INET, type, std::forward<CreateOpts>(opts)...);
+}
+
+// options are lambdas folded into CreateSocket at compile time, this type
+// only holds one picked at run time
 using CreateSocketOption = std::function<void(Socket&)>;
 
-inline CreateSocketOption
+inline auto
 WithBind(const SocketAddress& addr) {
     return [=] (Socket& socket) {
         socket.Bind(addr);
     };
 }
 
-inline CreateSocketOption
+inline auto
+WithConnect(const SocketAddress& addr) {
+    return [=](Socket& socket) {
+        socket.Connect(addr);
+    };
+}
+
+inline auto
 WithListen(int backlog) {
     return [=](Socket& socket) {
         socket.Listen(backlog);
     };
 }
 
-inline CreateSocketOption
+inline auto
 WithTimeoutOpt(int rcvtimeout, int sndtimeout) {
     return [=](Socket& socket) {
         if (rcvtimeout > 0) {
@@ -415,23 +647,38 @@ WithTimeoutOpt(int rcvtimeout, int sndtimeout) {
 }
 
 template<typename ... Opts>
-CreateSocketOption WithSocketOpts(Opts&& ... opts) {
+auto WithSocketOpts(Opts&& ... opts) {
     return [=](Socket& socket) {
         (socket.SetOpt(opts), ...);
     };
 }
 
-inline CreateSocketOption
+inline auto
 WithReuseSocketOpt(bool reuseaddr, bool reuserport) {
     return [=](Socket& socket) {
         socket.SetOpt(ReuseAddrSockOpt(reuseaddr));
 
 #ifndef _WIN32
-        socket.SetOpt(ReusePortSockOpt(reuseaddr));
+        socket.SetOpt(ReusePortSockOpt(reuserport));
 #endif
     };
 }
 
+#ifndef _WIN32
+// removes a stale filesystem socket left by a previous run, must precede WithBind
+inline auto
+WithUnlinkPath(const SocketAddress& addr) {
+    return [=](Socket&) {
+        if (AF_UNIX == addr.af() && !addr.un()->abstract()) {
+            auto path = addr.un()->path(addr.size());
+            if (!path.empty()) {
+                unlink(path.c_str());
+            }
+        }
+    };
+}
+#endif
+
 }
 
 #endif //_SOCKET_H_INCLUDED
@@ -0,0 +1,101 @@
+#ifndef _SPLICE_PIPE_H_INCLUDED
+#define _SPLICE_PIPE_H_INCLUDED
+
+#ifdef __linux__
+#include "socket.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace testing {
+// a non-blocking pipe that moves socket data with splice(2): Fill takes
+// pages from a socket receive queue, Drain hands them to a socket send
+// queue, and the bytes never reach user space. The pipe doubles as the
+// output queue, its capacity bounds what a slow reader can hold back.
+class SplicePipe {
+public:
+    SplicePipe() = default;
+    SplicePipe(const SplicePipe&) = delete;
+    SplicePipe& operator=(const SplicePipe&) = delete;
+
+    ~SplicePipe() {
+        Close();
+    }
+
+    // capacity above fs.pipe-max-size needs CAP_SYS_RESOURCE, the pipe
+    // keeps the default size then
+    void Open(std::error_code& ec, size_t capacity) noexcept {
+        int fds[2];
+        if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+            ec.assign(errno, std::system_category());
+            return;
+        }
+
+        r_ = fds[0];
+        w_ = fds[1];
+        fcntl(w_, F_SETPIPE_SZ, static_cast<int>(capacity));
+        capacity_ = static_cast<size_t>(fcntl(w_, F_GETPIPE_SZ));
+    }
+
+    void Open(size_t capacity) {
+        std::error_code ec;
+        Open(ec, capacity);
+        CheckAndThrowIfERR("pipe2", ec);
+    }
+
+    void Close() {
+        if (r_ >= 0) {
+            close(r_);
+            close(w_);
+            r_ = w_ = -1;
+        }
+
+        bytes_ = 0;
+    }
+
+    size_t capacity() const {
+        return capacity_;
+    }
+
+    // bytes spliced in and not yet out
+    size_t bytes() const {
+        return bytes_;
+    }
+
+    // socket to pipe, the bytes moved, 0 at eof or -1 with errno. EAGAIN
+    // also means the pipe ran out of slots: each one holds a page or a
+    // fragment of one, so a pipe can fill up before bytes() hits capacity.
+    ssize_t Fill(int fd) {
+        if (bytes_ >= capacity_) {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        ssize_t n = splice(fd, nullptr, w_, nullptr, capacity_ - bytes_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            bytes_ += n;
+        }
+
+        return n;
+    }
+
+    // pipe to socket, the bytes moved or -1 with errno
+    ssize_t Drain(int fd) {
+        ssize_t n = splice(r_, nullptr, fd, nullptr, bytes_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            bytes_ -= n;
+        }
+
+        return n;
+    }
+
+private:
+    int r_ = -1;
+    int w_ = -1;
+    size_t capacity_ = 0;
+    size_t bytes_ = 0;
+};
+}
+#endif
+
+#endif // !_SPLICE_PIPE_H_INCLUDED
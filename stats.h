@@ -0,0 +1,91 @@
+#ifndef _STATS_H_INCLUDED
+#define _STATS_H_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+namespace testing {
+inline uint64_t NowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// sleeps while the deadline is far and spins the last stretch, the
+// scheduler alone overshoots by tens of microseconds; returns NowNanos()
+inline uint64_t SleepUntil(uint64_t due_ns) {
+    uint64_t now;
+    while ((now = NowNanos()) < due_ns) {
+        if (due_ns - now > 100000) {
+            std::this_thread::sleep_for(std::chrono::nanoseconds(due_ns - now - 50000));
+        }
+    }
+
+    return now;
+}
+
+class LatencyStats {
+public:
+    void Reserve(size_t n) {
+        samples_.reserve(n);
+    }
+
+    void Add(uint64_t nanos) {
+        samples_.push_back(nanos);
+        sorted_ = false;
+    }
+
+    void Merge(const LatencyStats& other) {
+        samples_.insert(samples_.end(), other.samples_.begin(), other.samples_.end());
+        sorted_ = false;
+    }
+
+    void Clear() {
+        samples_.clear();
+    }
+
+    size_t count() const {
+        return samples_.size();
+    }
+
+    // p in [0, 100]
+    uint64_t Percentile(double p) {
+        if (samples_.empty()) {
+            return 0;
+        }
+
+        if (!sorted_) {
+            std::sort(samples_.begin(), samples_.end());
+            sorted_ = true;
+        }
+
+        size_t i = static_cast<size_t>(p / 100.0 * (samples_.size() - 1) + 0.5);
+        return samples_[std::min(i, samples_.size() - 1)];
+    }
+
+    static void PrintHeader(std::ostream& out) {
+        out << std::setw(12) << "p50(us)"
+            << std::setw(12) << "p99(us)"
+            << std::setw(12) << "p999(us)"
+            << std::setw(12) << "max(us)";
+    }
+
+    void Print(std::ostream& out) {
+        out << std::fixed << std::setprecision(1)
+            << std::setw(12) << Percentile(50) / 1e3
+            << std::setw(12) << Percentile(99) / 1e3
+            << std::setw(12) << Percentile(99.9) / 1e3
+            << std::setw(12) << Percentile(100) / 1e3;
+    }
+
+private:
+    std::vector<uint64_t> samples_;
+    bool sorted_ = false;
+};
+}
+
+#endif // !_STATS_H_INCLUDED
@@ -1,5 +1,6 @@
 #include "socket.h"
 #include "flags.h"
+#include "payload.h"
 
 #include <iostream>
 #include <thread>
@@ -10,6 +11,9 @@ DEFINE_int(dstport, -1, "remote udp port");
 DEFINE_bool(reuseaddr, false, "SO_REUSEADDR on");
 DEFINE_bool(reuseport, false, "SO_REUSEPORT on");
 DEFINE_string(msg, "", "send msg");
+DEFINE_string(unixpath, "", "connect to AF_UNIX path instead, '@name' for abstract");
+DEFINE_int(size, 0, "send N byte seeded patterns instead of msg and verify the echo");
+DEFINE_int(seed, 1, "pattern seed for -size");
 
 int main(int argc, char *argv[]) {
     using namespace testing;
@@ -19,7 +23,7 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
-    if (FLAG_port == -1) {
+    if (FLAG_port == -1 && !*FLAG_unixpath) {
         std::cerr << "invalid parameter port '-1'" << std::endl;
         return -1;
     }
@@ -28,29 +32,64 @@ int main(int argc, char *argv[]) {
 #ifdef _WIN32
         WinsockInitializer<> wsock_initializer;
 #endif
-        auto client = CreateSocket(
-            SOCK_STREAM,
-            WithReuseSocketOpt(FLAG_reuseaddr, FLAG_reuseport),
-            WithTimeoutOpt(2, 2),
-            WithBind(MakeAddress4(FLAG_port)));
+        Socket client;
+#ifndef _WIN32
+        if (*FLAG_unixpath) {
+            client = CreateSocketWithFamily(
+                AF_UNIX,
+                SOCK_STREAM,
+                WithTimeoutOpt(2, 2));
 
-        client.Connect(testing::MakeAddress4(FLAG_dstport));
+            client.Connect(MakeAddressUnix(FLAG_unixpath));
+        } else
+#endif
+        {
+            client = CreateSocket(
+                SOCK_STREAM,
+                WithReuseSocketOpt(FLAG_reuseaddr, FLAG_reuseport),
+                WithTimeoutOpt(2, 2),
+                WithBind(MakeAddress4(FLAG_port)));
+
+            client.Connect(testing::MakeAddress4(FLAG_dstport));
+        }
 
+        PayloadPattern pattern(std::max(FLAG_size, 0), FLAG_seed);
+        VerifyStats verify;
         while (true) {
-            int n = client.Send({ FLAG_msg, strlen(FLAG_msg) });
+            ConstBuffer req = { FLAG_msg, strlen(FLAG_msg) };
+            if (FLAG_size > 0) {
+                req = MakeBuffer(pattern.Next());
+            }
+
+            int n = client.Send(req);
             if (n <= 0) {
                 std::cerr << "send err" << std::endl;
                 return -1;
             }
 
-            std::string buf(1024, '\0');
-            n = client.Recv(MakeBuffer(buf));
-            if (n <= 0) {
+            // a stream echo may come back in pieces
+            std::string buf(std::max<size_t>(1024, req.second), '\0');
+            int got = 0;
+            do {
+                n = client.Recv({ &buf[got], buf.size() - got });
+                if (n <= 0) {
+                    break;
+                }
+
+                got += n;
+            } while (FLAG_size > 0 && got < static_cast<int>(req.second));
+
+            if (got <= 0) {
                 std::cerr << "recv err" << std::endl;
                 return -1;
             }
 
-            std::clog << "got a response " << buf << std::endl;
+            if (FLAG_size > 0) {
+                verify.Add(PayloadPattern::Verify(buf.data(), got, req.second));
+                std::clog << "got a response " << got << " bytes, " << verify << std::endl;
+            } else {
+                std::clog << "got a response " << buf << std::endl;
+            }
 
             std::this_thread::sleep_for(std::chrono::seconds(1));
         }
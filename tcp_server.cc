@@ -1,71 +1,542 @@
 #include "socket.h"
 #include "flags.h"
+#include "timer_wheel.h"
+#include "send_queue.h"
+#include "perf_counters.h"
+#include "capture.h"
+#include "stats.h"
+#include "procfs.h"
+#include "splice_pipe.h"
 
 #include <vector>
+#include <array>
 #include <thread>
 #include <memory>
 #include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <csignal>
+#endif
 
 DEFINE_int(port, 1234, "local port");
 DEFINE_bool(reuseport, false, "SO_REUSEPORT");
 DEFINE_bool(reuseaddr, false, "SO_REUSEADDR");
+DEFINE_string(unixpath, "", "also listen on AF_UNIX path, '@name' for abstract");
+DEFINE_bool(quiet, false, "no per msg log");
+DEFINE_int(backlog, testing::Socket::kListenBacklogDefault, "listen backlog");
+DEFINE_int(sndhigh, 256 * 1024, "stop reading a connection with this many reply bytes queued");
+DEFINE_int(sndlow, 64 * 1024, "resume reading once the reply queue drains below this");
+DEFINE_bool(perf, false, "report perf_event counters per connection thread on exit");
+DEFINE_string(capture, "", "append every received segment to this capture file");
+DEFINE_int(idletimeout, 0, "close connections without any traffic for N ms, 0 off");
+DEFINE_int(readtimeout, 0, "close connections whose recv waits longer than N ms, 0 off");
+DEFINE_int(writetimeout, 0, "close connections whose send blocks longer than N ms, 0 off");
+DEFINE_bool(splice, false, "echo through a per connection pipe with splice(2), no user space copy");
 
 namespace {
+// timer wheels sharded by connection, each behind its own lock, all
+// ticked by one thread. A shard's lock is only held to file, cancel and
+// collect nodes; callbacks run after it is released, with their timer
+// marked firing so Cancel can wait them out before the owner goes away.
+class TimerService {
+public:
+    static constexpr int kTickMs = 10;
+    static constexpr size_t kShards = 16;
+
+    // a wheel node that knows its shard and whether its callback is running
+    struct Timer : testing::TimerNode {
+        Timer(size_t shard, std::function<void()> cb)
+            : TimerNode(std::move(cb))
+            , shard(shard % kShards) {}
+
+        size_t shard;
+        std::atomic<bool> firing{ false };
+    };
+
+    TimerService() {
+        thread_ = std::thread([this] {
+            std::vector<Timer *> due;
+            std::unique_lock<std::mutex> lock(mutex_);
+            while (!stop_) {
+                cv_.wait_for(lock, std::chrono::milliseconds(kTickMs));
+                lock.unlock();
+
+                uint64_t now = NowTick();
+                for (auto& shard : shards_) {
+                    {
+                        std::lock_guard<std::mutex> guard(shard.mutex);
+                        shard.wheel.Expire(now, [&due](testing::TimerNode *node) {
+                            auto timer = static_cast<Timer *>(node);
+                            timer->firing.store(true);
+                            due.push_back(timer);
+                        });
+                    }
+
+                    // the owner may be freed once firing drops
+                    for (Timer *timer : due) {
+                        timer->callback();
+                        timer->firing.store(false);
+                    }
+
+                    due.clear();
+                }
+
+                lock.lock();
+            }
+        });
+    }
+
+    ~TimerService() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+        }
+
+        cv_.notify_all();
+        thread_.join();
+    }
+
+    // fires once the steady clock reaches at_ms, never before
+    void ScheduleAt(Timer *timer, uint64_t at_ms) {
+        Shard& shard = shards_[timer->shard];
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        shard.wheel.Schedule(timer, (at_ms + kTickMs - 1) / kTickMs);
+    }
+
+    // takes the timer out of its wheel and waits for a callback that is
+    // running to return; not for use from the timer's own callback
+    void Cancel(Timer *timer) {
+        Shard& shard = shards_[timer->shard];
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                if (!timer->firing.load()) {
+                    shard.wheel.Cancel(timer);
+                    return;
+                }
+            }
+
+            std::this_thread::yield();
+        }
+    }
+
+    static uint64_t NowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    static uint64_t NowTick() {
+        return NowMs() / kTickMs;
+    }
+
+    struct Shard {
+        Shard() : wheel(NowTick()) {}
+
+        std::mutex mutex;
+        testing::TimerWheel wheel;
+    };
+
+    std::mutex mutex_;  // guards stop_
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::array<Shard, kShards> shards_;
+    std::thread thread_;
+};
+
+// a timeout that is pushed back on nearly every message. Arm and Disarm
+// only store the deadline; the shard lock is taken to file the node when
+// it is not in the wheel, and a node that comes due before the deadline
+// it stands for is filed again at that deadline instead of firing. A busy
+// connection so takes the lock about once per timeout period instead of
+// several times per message. Deadlines only move later, so the node is
+// never filed past the one it has to meet.
+class DeadlineTimer {
+public:
+    DeadlineTimer(TimerService *timers, size_t shard, int timeout_ms, std::function<void()> on_expire)
+        : timers_(timers)
+        , timeout_ms_(timeout_ms)
+        , on_expire_(std::move(on_expire))
+        , node_(shard, [this] { OnDue(); }) {}
+
+    void Arm() {
+        if (!timers_ || timeout_ms_ <= 0) {
+            return;
+        }
+
+        uint64_t deadline = TimerService::NowMs() + timeout_ms_;
+        deadline_ms_.store(deadline);
+        if (!queued_.exchange(true)) {
+            timers_->ScheduleAt(&node_, deadline);
+        }
+    }
+
+    void Disarm() {
+        deadline_ms_.store(0);
+    }
+
+    // takes the node out of the wheel, the owner may be freed afterwards
+    void Cancel() {
+        if (!timers_ || timeout_ms_ <= 0) {
+            return;
+        }
+
+        deadline_ms_.store(0);
+        timers_->Cancel(&node_);
+        queued_.store(false);
+    }
+
+private:
+    // runs on the timer thread without any lock held, Cancel waits for it
+    void OnDue() {
+        uint64_t deadline = deadline_ms_.load();
+        while (0 != deadline) {
+            if (TimerService::NowMs() < deadline) {
+                timers_->ScheduleAt(&node_, deadline);
+                return;
+            }
+
+            if (deadline_ms_.compare_exchange_weak(deadline, 0)) {
+                on_expire_();
+                break;
+            }
+        }
+
+        // an Arm that still saw the node queued is picked up here
+        queued_.store(false);
+        deadline = deadline_ms_.load();
+        if (0 != deadline && !queued_.exchange(true)) {
+            timers_->ScheduleAt(&node_, deadline);
+        }
+    }
+
+    TimerService *timers_;
+    int timeout_ms_;
+    std::function<void()> on_expire_;
+    std::atomic<uint64_t> deadline_ms_{ 0 };  // steady clock ms, 0 disarmed
+    std::atomic<bool> queued_{ false };  // node_ is in the wheel or firing
+    TimerService::Timer node_;
+};
+
 class TCPClient : public std::enable_shared_from_this<TCPClient> {
 public:
-    TCPClient(int id, testing::Socket&& client) : id_(id), client_(std::move(client)) {}
+    TCPClient(int id,
+              testing::Socket&& client,
+              const testing::SocketAddress& peer,
+              TimerService *timers,
+              testing::CaptureWriter *capture,
+              std::function<void()> on_exit)
+        : id_(id)
+        , client_(std::move(client))
+        , peer_(peer)
+        , capture_(capture)
+        , on_exit_(std::move(on_exit))
+        , idle_timer_(timers, id, FLAG_idletimeout, [this] { OnTimeout("idle"); })
+        , read_timer_(timers, id, FLAG_readtimeout, [this] { OnTimeout("read"); })
+        , write_timer_(timers, id, FLAG_writetimeout, [this] { OnTimeout("write"); }) {}
 
     void Start() {
        std::thread([sp = shared_from_this()] {
-            char xxx[1024];
-
-            while (true) {
-                auto buf = testing::MakeBuffer(xxx);
-                int n = sp->client_.Recv(buf);
-                if (n <= 0) {
-                    break;
-                }
+            testing::PerfCounters perf;
+            if (FLAG_perf) {
+                perf.Open();
+                perf.Start();
+            }
 
-                std::clog << "client #" << sp->id_ << " got a msg " << n << std::endl;
+            sp->idle_timer_.Arm();
+#ifdef _WIN32
+            sp->BlockingLoop();
+#else
+#ifdef __linux__
+            if (FLAG_splice && !sp->capture_) {
+                sp->SpliceLoop();
+            } else
+#endif
+            {
+                sp->QueuedLoop();
+            }
+#endif
 
-                buf.second = n;
-                sp->client_.Send(buf);
+            if (FLAG_perf) {
+                perf.Stop();
+                std::clog << perf.Report("client #" + std::to_string(sp->id_), sp->packets_) + '\n' << std::flush;
             }
+
+            // nodes must leave the wheel before the client can be freed
+            sp->idle_timer_.Cancel();
+            sp->read_timer_.Cancel();
+            sp->write_timer_.Cancel();
+            sp->on_exit_();
         }).detach();
     }
 
+    // the socket is closed by the last owner once the client thread exits
     void Stop() {
-        client_.Close();
+        std::error_code ec;
+        client_.Shutdown(ec);
     }
 
 private:
+#ifdef _WIN32
+    void BlockingLoop() {
+        char xxx[1024];
+
+        while (true) {
+            auto buf = testing::MakeBuffer(xxx);
+            read_timer_.Arm();
+            int n = client_.Recv(buf);
+            read_timer_.Disarm();
+            if (n <= 0) {
+                break;
+            }
+
+            buf.second = n;
+            OnMessage(buf);
+
+            write_timer_.Arm();
+            client_.Send(buf);
+            write_timer_.Disarm();
+            idle_timer_.Arm();
+        }
+    }
+#else
+    // reads everything the peer has pipelined, queues the replies and sends
+    // the batch with one vectored send. While the queue is above its high
+    // watermark the peer is not read from, so a slow reader only costs the
+    // watermark in memory and never loses a partially written reply.
+    void QueuedLoop() {
+        testing::SendQueue queue(FLAG_sndhigh, FLAG_sndlow);
+        char xxx[1024];
+        bool eof = false;
+
+        while (!eof || !queue.empty()) {
+            short events = 0;
+            if (!eof && !queue.paused()) {
+                events |= POLLIN;
+            }
+
+            if (!queue.empty()) {
+                events |= POLLOUT;
+                write_timer_.Arm();
+            } else {
+                write_timer_.Disarm();
+                read_timer_.Arm();
+            }
+
+            int revents = client_.Poll(events);
+            if (revents < 0 && EINTR == errno) {
+                continue;
+            }
+
+            if (revents < 0 || (revents & (POLLERR | POLLNVAL))) {
+                break;
+            }
+
+            if (revents & (POLLIN | POLLHUP)) {
+                read_timer_.Disarm();
+
+                while (!queue.paused()) {
+                    auto buf = testing::MakeBuffer(xxx);
+                    int n = client_.Recv(buf, MSG_DONTWAIT);
+                    if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+                        break;
+                    }
+
+                    if (n <= 0) {
+                        eof = true;
+                        break;
+                    }
+
+                    buf.second = n;
+                    OnMessage(buf);
+                    queue.Push(buf);
+                }
+
+                idle_timer_.Arm();
+            }
+
+            if (!queue.empty()) {
+                int n = queue.Flush(client_, MSG_DONTWAIT | MSG_NOSIGNAL);
+                if (n < 0 && EAGAIN != errno && EWOULDBLOCK != errno) {
+                    break;
+                }
+
+                if (n > 0) {
+                    idle_timer_.Arm();
+                }
+            }
+        }
+    }
+#endif
+
+#ifdef __linux__
+    // same shape as QueuedLoop with the pipe as the queue: read while it
+    // has room, write while it holds data. Data is counted and logged but
+    // never seen, so it cannot be captured.
+    void SpliceLoop() {
+        testing::SplicePipe pipe;
+        std::error_code ec;
+        pipe.Open(ec, FLAG_sndhigh);
+        if (ec) {
+            std::clog << "client #" << id_ << " pipe2 " << ec.message() << std::endl;
+            return;
+        }
+
+        int fd = client_.native_handle();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        bool eof = false;
+        bool stalled = false;  // pipe out of slots, wait until it drains
+
+        while (!eof || pipe.bytes() > 0) {
+            short events = 0;
+            if (!eof && !stalled) {
+                events |= POLLIN;
+            }
+
+            if (pipe.bytes() > 0) {
+                events |= POLLOUT;
+                write_timer_.Arm();
+            } else {
+                write_timer_.Disarm();
+                read_timer_.Arm();
+            }
+
+            int revents = client_.Poll(events);
+            if (revents < 0 && EINTR == errno) {
+                continue;
+            }
+
+            if (revents < 0 || (revents & (POLLERR | POLLNVAL))) {
+                break;
+            }
+
+            if (revents & (POLLIN | POLLHUP)) {
+                read_timer_.Disarm();
+
+                ssize_t n;
+                while ((n = pipe.Fill(fd)) > 0) {
+                    ++packets_;
+                    if (!FLAG_quiet) {
+                        std::clog << "client #" << id_ << " spliced " << n << std::endl;
+                    }
+                }
+
+                if (0 == n) {
+                    eof = true;
+                } else if (EAGAIN != errno) {
+                    break;
+                } else {
+                    stalled = pipe.bytes() > 0;
+                }
+
+                idle_timer_.Arm();
+            }
+
+            if (pipe.bytes() > 0) {
+                ssize_t n = pipe.Drain(fd);
+                if (n < 0 && EAGAIN != errno) {
+                    break;
+                }
+
+                if (n > 0) {
+                    stalled = false;
+                    idle_timer_.Arm();
+                }
+            }
+        }
+    }
+#endif
+
+    void OnMessage(testing::ConstBuffer buf) {
+        ++packets_;
+        if (capture_) {
+            capture_->Write(SOCK_STREAM, peer_, buf);
+        }
+
+        if (!FLAG_quiet) {
+            std::clog << "client #" << id_ << " got a msg " << buf.second << std::endl;
+        }
+    }
+
+    // runs on the timer thread, the blocked recv/send returns once shut down
+    void OnTimeout(const char *what) {
+        if (!FLAG_quiet) {
+            std::clog << "client #" << id_ << ' ' << what << " timeout" << std::endl;
+        }
+
+        Stop();
+    }
+
     int id_;
+    uint64_t packets_ = 0;
     testing::Socket client_;
+    testing::SocketAddress peer_;
+    testing::CaptureWriter *capture_;
+    std::function<void()> on_exit_;
+    DeadlineTimer idle_timer_;
+    DeadlineTimer read_timer_;
+    DeadlineTimer write_timer_;
 };
 
 class TCPServer {
 public:
-    TCPServer() { Start(); }
+    TCPServer(const testing::SocketAddress& addr, testing::CaptureWriter *capture)
+        : addr_(addr)
+        , capture_(capture) {
+        Start();
+    }
+
     ~TCPServer() { Stop();  }
 
     void Start() {
-        server_ = testing::CreateSocket(
-            SOCK_STREAM,
-            testing::WithReuseSocketOpt(FLAG_reuseaddr, FLAG_reuseport),
-            testing::WithBind(testing::MakeAddress4(FLAG_port)));
+        if (FLAG_idletimeout > 0 || FLAG_readtimeout > 0 || FLAG_writetimeout > 0) {
+            timers_ = std::make_unique<TimerService>();
+        }
+
+        if (AF_INET == addr_.af()) {
+            server_ = testing::CreateSocket(
+                SOCK_STREAM,
+                testing::WithReuseSocketOpt(FLAG_reuseaddr, FLAG_reuseport),
+                testing::WithBind(addr_));
+        } else {
+#ifndef _WIN32
+            server_ = testing::CreateSocketWithFamily(
+                addr_.af(),
+                SOCK_STREAM,
+                testing::WithUnlinkPath(addr_),
+                testing::WithBind(addr_));
+#endif
+        }
 
-        server_.Listen();
+        server_.Listen(FLAG_backlog);
 
         thread_ = std::thread([this] {
-            std::clog << "tcp server startup" << std::endl;
+            std::clog << "tcp server startup " << addr_.ToString() << std::endl;
 
             try {
                 testing::Socket c;
                 testing::SocketAddress addr;
                 while (server_.Accept(&c, &addr)) {
-                    std::clog << "got a client " << addr.v4()->ip() << ',' << addr.v4()->port() << std::endl;
+                    if (!FLAG_quiet) {
+                        std::clog << "got a client " << addr.ToString() << std::endl;
+                    }
 
-                    auto client = std::make_shared<TCPClient>(client_index_++, std::move(c));
+                    {
+                        std::lock_guard<std::mutex> lock(mutex_);
+                        ++live_clients_;
+                    }
+
+                    auto client = std::make_shared<TCPClient>(
+                        client_index_++,
+                        std::move(c),
+                        addr,
+                        timers_.get(),
+                        capture_,
+                        [this] { OnClientExit(); });
                     clients_.emplace_back(client);
                     client->Start();
                 }
@@ -75,23 +546,43 @@ public:
     }
 
     void Stop() {
+        std::error_code ec;
+        server_.Shutdown(ec);
+
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+
+        server_.Close();
+
         for (auto&& c : clients_) {
             if (auto sp = c.lock(); sp) {
                 sp->Stop();
             }
         }
 
-        server_.Close();
-
-        if (thread_.joinable()) {
-            thread_.join();
-        }
+        // client threads use the timers, wait for them before they go away
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return 0 == live_clients_; });
     }
 private:
+    void OnClientExit() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (0 == --live_clients_) {
+            cv_.notify_all();
+        }
+    }
+
+    testing::SocketAddress addr_;
+    testing::CaptureWriter *capture_;
     testing::Socket server_;
     std::thread thread_;
+    std::unique_ptr<TimerService> timers_;
     std::vector<std::weak_ptr<TCPClient>> clients_;
     std::atomic_int client_index_ = 0;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    int live_clients_ = 0;
 };
 }
 
@@ -101,15 +592,40 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+#ifdef __linux__
+    // one descriptor per connection
+    testing::RaiseOpenFileLimit();
+#endif
+
     try {
 #ifdef _WIN32
         testing::WinsockInitializer<> winsock_initializer;
 #endif 
-        TCPServer server;
+#ifdef __linux__
+        if (FLAG_splice) {
+            // splice has no MSG_NOSIGNAL, a peer that resets would kill us
+            signal(SIGPIPE, SIG_IGN);
+            if (*FLAG_capture) {
+                std::clog << "-capture needs the data in user space, -splice is ignored" << std::endl;
+            }
+        }
+#endif
+        std::unique_ptr<testing::CaptureWriter> capture;
+        if (*FLAG_capture) {
+            capture = std::make_unique<testing::CaptureWriter>(FLAG_capture);
+        }
+
+        std::vector<std::unique_ptr<TCPServer>> servers;
+        servers.emplace_back(std::make_unique<TCPServer>(testing::MakeAddress4(FLAG_port), capture.get()));
+#ifndef _WIN32
+        if (*FLAG_unixpath) {
+            servers.emplace_back(std::make_unique<TCPServer>(testing::MakeAddressUnix(FLAG_unixpath), capture.get()));
+        }
+#endif
         std::cin.get();
     } catch (const testing::SocketException& e) {
         std::cerr << e.what() << '\t' << e.error_code().message() << std::endl;
     }
 
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,194 @@
+#ifndef _TIMER_WHEEL_H_INCLUDED
+#define _TIMER_WHEEL_H_INCLUDED
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+namespace testing {
+// intrusive list node, embedded in the owner so scheduling never allocates
+struct TimerNode {
+    TimerNode() = default;
+    explicit TimerNode(std::function<void()> cb) : callback(std::move(cb)) {}
+
+    TimerNode(const TimerNode&) = delete;
+    TimerNode& operator=(const TimerNode&) = delete;
+
+    bool pending() const {
+        return nullptr != next;
+    }
+
+    std::function<void()> callback;
+    uint64_t expire = 0;
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+};
+
+// hierarchical timing wheel in the style of the classic linux timers: a
+// 256 slot root wheel plus three 64 slot wheels, each slot a circular list.
+// Schedule/Cancel are O(1), Advance is O(1) per tick plus the timers due,
+// nodes in upper wheels cascade down once per revolution of the wheel below.
+// Not thread safe, the owner serializes access.
+class TimerWheel {
+public:
+    static constexpr int kRootBits = 8;
+    static constexpr int kLevelBits = 6;
+    static constexpr int kLevels = 4;
+    static constexpr uint64_t kRootSize = uint64_t(1) << kRootBits;
+    static constexpr uint64_t kLevelSize = uint64_t(1) << kLevelBits;
+    static constexpr uint64_t kMaxDelta =
+        (uint64_t(1) << (kRootBits + (kLevels - 1) * kLevelBits)) - 1;
+
+    explicit TimerWheel(uint64_t now = 0) : current_(now) {
+        for (auto& s : root_) {
+            s.prev = s.next = &s;
+        }
+
+        for (auto& level : levels_) {
+            for (auto& s : level) {
+                s.prev = s.next = &s;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    uint64_t now() const {
+        return current_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    // (re)arms node to fire once the wheel has advanced to tick expire,
+    // ticks already passed fire on the next Advance
+    void Schedule(TimerNode *node, uint64_t expire) {
+        Cancel(node);
+
+        if (expire < current_) {
+            expire = current_;
+        } else if (expire - current_ > kMaxDelta) {
+            expire = current_ + kMaxDelta;
+        }
+
+        node->expire = expire;
+        Link(node);
+        ++size_;
+    }
+
+    void Cancel(TimerNode *node) {
+        if (node->pending()) {
+            Unlink(node);
+            --size_;
+        }
+    }
+
+    // fires every timer due up to and including tick now, a callback may
+    // schedule or cancel any node, including its own
+    size_t Advance(uint64_t now) {
+        return Expire(now, [](TimerNode *node) {
+            if (node->callback) {
+                node->callback();
+            }
+        });
+    }
+
+    // unlinks every timer due up to and including tick now and hands it to
+    // collect instead of running its callback, for owners that run the
+    // callbacks after releasing the lock that guards the wheel
+    template<typename Collect>
+    size_t Expire(uint64_t now, Collect&& collect) {
+        size_t fired = 0;
+        while (current_ <= now) {
+            size_t index = current_ & (kRootSize - 1);
+            if (0 == index) {
+                Cascade();
+            }
+
+            TimerNode *slot = &root_[index];
+            while (slot->next != slot) {
+                TimerNode *node = slot->next;
+                Unlink(node);
+                --size_;
+                ++fired;
+                collect(node);
+            }
+
+            ++current_;
+        }
+
+        return fired;
+    }
+
+private:
+    void Link(TimerNode *node) {
+        uint64_t expire = node->expire;
+        uint64_t delta = expire - current_;
+
+        TimerNode *slot;
+        if (delta < kRootSize) {
+            slot = &root_[expire & (kRootSize - 1)];
+        } else {
+            int level = 0;
+            int shift = kRootBits;
+            while (level < kLevels - 2 && delta >= (uint64_t(1) << (shift + kLevelBits))) {
+                ++level;
+                shift += kLevelBits;
+            }
+
+            slot = &levels_[level][(expire >> shift) & (kLevelSize - 1)];
+        }
+
+        node->prev = slot->prev;
+        node->next = slot;
+        slot->prev->next = node;
+        slot->prev = node;
+    }
+
+    static void Unlink(TimerNode *node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+    }
+
+    // called when the root wheel wraps, pulls the due slot of each upper
+    // wheel down a level, stopping at the first wheel that did not wrap
+    void Cascade() {
+        int shift = kRootBits;
+        for (auto& level : levels_) {
+            size_t index = (current_ >> shift) & (kLevelSize - 1);
+
+            TimerNode *slot = &level[index];
+            TimerNode list;
+            if (slot->next != slot) {
+                list.next = slot->next;
+                list.prev = slot->prev;
+                list.next->prev = &list;
+                list.prev->next = &list;
+                slot->prev = slot->next = slot;
+
+                while (list.next != &list) {
+                    TimerNode *node = list.next;
+                    Unlink(node);
+                    Link(node);
+                }
+            }
+
+            if (0 != index) {
+                break;
+            }
+
+            shift += kLevelBits;
+        }
+    }
+
+    TimerNode root_[kRootSize];
+    TimerNode levels_[kLevels - 1][kLevelSize];
+    uint64_t current_;
+    size_t size_ = 0;
+};
+}
+
+#endif // !_TIMER_WHEEL_H_INCLUDED
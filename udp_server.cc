@@ -1,70 +1,374 @@
 #include "socket.h"
 #include "flags.h"
+#include "capture.h"
+#include "rate_limiter.h"
+#include "server.h"
+#include "stats.h"
+#include "procfs.h"
 
 #include <iostream>
-#include <thread>
 #include <vector>
+#include <memory>
+#include <algorithm>
+#include <atomic>
+
+#ifndef _WIN32
+#include <csignal>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#endif
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
 
 DEFINE_int(port, -1, "local udp port");
 DEFINE_bool(reuseaddr, false, "SO_REUSEADDR on");
 DEFINE_bool(reuseport, false, "SO_REUSEPORT on");
 DEFINE_int(thread, 1, "thread num");
+DEFINE_string(unixpath, "", "also serve AF_UNIX dgram path, '@name' for abstract");
+DEFINE_bool(quiet, false, "no per msg log");
+DEFINE_int(busypoll, 0, "SO_BUSY_POLL usecs and spin on MSG_DONTWAIT, 0 off");
+DEFINE_int(spinmax, 1 << 16, "max empty polls before blocking in busypoll mode");
+DEFINE_bool(perf, false, "report perf_event counters per worker on exit");
+DEFINE_string(capture, "", "append every received datagram to this capture file");
+DEFINE_int(fork, 0, "prefork N worker processes sharing the port, each with -thread threads");
+DEFINE_int(stats, 0, "print per worker process stats every N seconds in -fork mode");
+DEFINE_int(minuptime, 1000, "ms a -fork worker must run for its exit to count as a crash, not a failed start");
+DEFINE_int(maxfails, 5, "give up after N failed starts of one -fork worker in a row");
+DEFINE_int(ratelimit, 0, "max datagrams/s per ipv4 peer, the rest are dropped unanswered, 0 off");
+DEFINE_int(burst, 64, "datagrams a peer may send back to back under -ratelimit");
+DEFINE_int(ratetable, 65536, "peers tracked by -ratelimit, the longest idle are evicted");
+DEFINE_int(connect, 0, "give up to N ipv4 peers per worker their own connected socket, 0 off");
+DEFINE_int(flowidle, 30000, "close a -connect flow after N ms without datagrams, 0 never");
 
 namespace {
-class UDPServer {
-public:
-    UDPServer(int id)
-        : id_(id) {
-        Start();
-    }
+// counters a worker process shares with the supervisor, they live in a
+// MAP_SHARED mapping created before fork and survive worker restarts
+struct WorkerStats {
+    std::atomic<uint64_t> packets;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> shed;
+};
 
-    UDPServer(UDPServer&&) = default;
+// Stats policy of the servers, counts locally and in WorkerStats
+struct SharedStats : testing::CountingStats {
+    WorkerStats *shared;
 
-    ~UDPServer() {
-        Stop();
+    void OnPacket(size_t n) {
+        CountingStats::OnPacket(n);
+        if (shared) {
+            shared->packets.fetch_add(1, std::memory_order_relaxed);
+            shared->bytes.fetch_add(n, std::memory_order_relaxed);
+        }
+    }
+
+    void OnShed() {
+        CountingStats::OnShed();
+        if (shared) {
+            shared->shed.fetch_add(1, std::memory_order_relaxed);
+        }
     }
+};
 
-    void Start() {
-        server_ = testing::CreateSocket(
+testing::Socket OpenServerSocket(const testing::SocketAddress& addr) {
+#ifndef _WIN32
+    if (AF_INET != addr.af()) {
+        return testing::CreateSocketWithFamily(
+            addr.af(),
             SOCK_DGRAM,
-            testing::WithReuseSocketOpt(FLAG_reuseaddr, FLAG_reuseport),
-            testing::WithBind(testing::MakeAddress4(FLAG_port)));
+            testing::WithUnlinkPath(addr),
+            testing::WithBind(addr));
+    }
+#endif
+    return testing::CreateSocket(
+        SOCK_DGRAM,
+        testing::WithReuseSocketOpt(FLAG_reuseaddr, FLAG_reuseport),
+        testing::WithBind(addr));
+}
+
+// every flag is turned into a type: each combination of -busypoll,
+// -connect, -ratelimit, -capture and -quiet in use is its own Server
+// instantiation and nothing is decided per message
+std::unique_ptr<testing::ServerBase> MakeServer(int id,
+                                                const testing::SocketAddress& addr,
+                                                testing::CaptureWriter *capture,
+                                                WorkerStats *stats,
+                                                testing::PeerRateLimiter *limiter) {
+    using namespace testing;
+
+    auto name = "udp server " + std::to_string(id);
+    auto socket = OpenServerSocket(addr);
+    std::clog << name << " startup " << addr.ToString() << std::endl;
+
+    auto make = [&](auto engine) {
+        return ChooseStages(
+            [&](auto ... stages) -> std::unique_ptr<ServerBase> {
+                using Handler = Pipeline<decltype(stages)..., EchoStage>;
+                return std::make_unique<Server<DatagramTransport, decltype(engine), Handler, SharedStats>>(
+                    name, std::move(socket), SocketAddress(), engine,
+                    Handler(stages..., EchoStage()), SharedStats{ {}, stats }, FLAG_perf);
+            },
+            std::tuple<>(),
+            limiter ? std::optional<RateLimitStage>(RateLimitStage{ limiter }) : std::nullopt,
+            std::optional<CountStage>(CountStage()),
+            capture ? std::optional<CaptureStage>(CaptureStage{ capture, SOCK_DGRAM }) : std::nullopt,
+            FLAG_quiet ? std::nullopt : std::optional<LogStage>(LogStage{ name }));
+    };
+
+#ifdef __linux__
+    if (FLAG_connect > 0 && AF_INET == addr.af()) {
+        return make(FlowEngine{ addr, static_cast<size_t>(FLAG_connect), FLAG_reuseaddr, FLAG_flowidle });
+    }
+
+    if (FLAG_busypoll > 0) {
+        return make(BusyPollEngine{ FLAG_busypoll, FLAG_spinmax });
+    }
+#endif
+    return make(BlockingEngine());
+}
+
+using ServerList = std::vector<std::unique_ptr<testing::ServerBase>>;
 
-        thread_ = std::thread([this] {
-            std::clog << "udp server " << id_ << " startup" << std::endl;
+// one table per process, every worker thread checks its peers against it
+std::unique_ptr<testing::PeerRateLimiter> MakeRateLimiter() {
+    if (FLAG_ratelimit <= 0) {
+        return nullptr;
+    }
 
-            testing::SocketAddress peer;
-            char xxx[1024];
+    return std::make_unique<testing::PeerRateLimiter>(FLAG_ratelimit, FLAG_burst, FLAG_ratetable);
+}
 
-            try {
-                while (true) {
-                    auto buf = testing::MakeBuffer(xxx);
-                    int n = server_.RecvFrom(buf, peer);
-                    if (n <= 0) {
-                        break;
-                    }
+ServerList StartServers(int first_id,
+                        bool with_unix,
+                        testing::CaptureWriter *capture,
+                        WorkerStats *stats,
+                        testing::PeerRateLimiter *limiter) {
+    ServerList servers;
+    for (int i = 0; i < FLAG_thread; ++i) {
+        servers.emplace_back(MakeServer(first_id + i, testing::MakeAddress4(FLAG_port), capture, stats, limiter));
+    }
 
-                    std::clog << "udp server " << id_ << " got a msg from " << peer.v4()->ip() << ',' << peer.v4()->port() << std::endl;
-                    buf.second = n;
-                    server_.SendTo(buf, peer);
-                }
-            } catch (...) {}
-        });
+#ifndef _WIN32
+    if (with_unix && *FLAG_unixpath) {
+        servers.emplace_back(MakeServer(first_id + FLAG_thread, testing::MakeAddressUnix(FLAG_unixpath), capture, stats, limiter));
     }
+#endif
+
+    return servers;
+}
+
+#ifndef _WIN32
+// forks worker processes that join the same reuseport group, restarts any
+// that exit while running and reports the counters they share with it. A
+// worker that exits within -minuptime of its start failed to start, most
+// likely for good (bind, -capture path, EMFILE): it is restarted after a
+// delay that doubles with every failure in a row, and after -maxfails of
+// them the supervisor stops all workers and gives up.
+class Supervisor {
+public:
+    static constexpr uint64_t kFirstBackoffNs = 100000000;
+    static constexpr uint64_t kMaxBackoffNs = 10000000000;
 
-    void Stop() {
-        server_.Close();
+    explicit Supervisor(int workers)
+        : workers_(workers)
+        , pids_(workers, -1)
+        , restarts_(workers, 0)
+        , failures_(workers, 0)
+        , started_(workers, 0)
+        , respawn_at_(workers, 0)
+        , last_packets_(workers, 0) {
+        void *p = mmap(nullptr, sizeof(WorkerStats) * workers_,
+                       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (MAP_FAILED == p) {
+            testing::CheckAndThrowIfERR("mmap");
+        }
 
-        if (thread_.joinable()) {
-            thread_.join();
+        stats_ = static_cast<WorkerStats *>(p);
+        for (int i = 0; i < workers_; ++i) {
+            new (&stats_[i]) WorkerStats{ { 0 }, { 0 }, { 0 } };
         }
     }
 
+    ~Supervisor() {
+        munmap(stats_, sizeof(WorkerStats) * workers_);
+    }
+
+    // until stdin gets a line or closes, like the threaded mode; false
+    // when a worker kept failing to start
+    bool Run() {
+        for (int i = 0; i < workers_; ++i) {
+            pids_[i] = Spawn(i);
+        }
+
+        last_report_ = testing::NowNanos();
+        bool ok = true;
+        while (true) {
+            pollfd pfd = { 0, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) > 0) {
+                break;
+            }
+
+            if (!Reap()) {
+                ok = false;
+                break;
+            }
+
+            Respawn();
+
+            if (FLAG_stats > 0 && testing::NowNanos() - last_report_ >= FLAG_stats * 1000000000ull) {
+                Report();
+            }
+        }
+
+        for (pid_t pid : pids_) {
+            if (pid > 0) {
+                kill(pid, SIGTERM);
+            }
+        }
+
+        for (pid_t pid : pids_) {
+            if (pid > 0) {
+                waitpid(pid, nullptr, 0);
+            }
+        }
+
+        Report();
+        return ok;
+    }
+
 private:
-    int id_;
-    std::thread thread_;
-    testing::Socket server_;
+    pid_t Spawn(int index) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            testing::CheckAndThrowIfERR("fork");
+        }
+
+        if (0 == pid) {
+            WorkerMain(index);
+        }
+
+        started_[index] = testing::NowNanos();
+        std::clog << "worker " << index << " pid " << pid << " started" << std::endl;
+        return pid;
+    }
+
+    // false once a worker has failed -maxfails starts in a row
+    bool Reap() {
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            auto it = std::find(pids_.begin(), pids_.end(), pid);
+            if (pids_.end() == it) {
+                continue;
+            }
+
+            int index = static_cast<int>(it - pids_.begin());
+            if (WIFSIGNALED(status)) {
+                std::clog << "worker " << index << " pid " << pid << " killed by signal " << WTERMSIG(status) << std::endl;
+            } else {
+                std::clog << "worker " << index << " pid " << pid << " exited " << WEXITSTATUS(status) << std::endl;
+            }
+
+            *it = -1;
+            uint64_t now = testing::NowNanos();
+            if (now - started_[index] >= FLAG_minuptime * 1000000ull) {
+                // it ran, restart it right away
+                failures_[index] = 0;
+                respawn_at_[index] = now;
+                continue;
+            }
+
+            if (++failures_[index] >= FLAG_maxfails) {
+                std::clog << "worker " << index << " failed to start " << failures_[index] << " times in a row, giving up" << std::endl;
+                return false;
+            }
+
+            uint64_t backoff = std::min(kFirstBackoffNs << (failures_[index] - 1), kMaxBackoffNs);
+            respawn_at_[index] = now + backoff;
+            std::clog << "worker " << index << " failed to start, retrying in " << backoff / 1000000 << " ms" << std::endl;
+        }
+
+        return true;
+    }
+
+    void Respawn() {
+        uint64_t now = testing::NowNanos();
+        for (int i = 0; i < workers_; ++i) {
+            if (pids_[i] < 0 && respawn_at_[i] <= now) {
+                ++restarts_[i];
+                pids_[i] = Spawn(i);
+            }
+        }
+    }
+
+    void Report() {
+        uint64_t now = testing::NowNanos();
+        double secs = (now - last_report_) / 1e9;
+        last_report_ = now;
+
+        uint64_t total = 0;
+        for (int i = 0; i < workers_; ++i) {
+            uint64_t packets = stats_[i].packets.load(std::memory_order_relaxed);
+            std::clog << "worker " << i << " pid " << pids_[i]
+                      << " restarts " << restarts_[i]
+                      << " packets " << packets
+                      << " bytes " << stats_[i].bytes.load(std::memory_order_relaxed)
+                      << " shed " << stats_[i].shed.load(std::memory_order_relaxed)
+                      << " pps " << static_cast<uint64_t>((packets - last_packets_[i]) / secs) << std::endl;
+            total += packets - last_packets_[i];
+            last_packets_[i] = packets;
+        }
+
+        std::clog << "all workers pps " << static_cast<uint64_t>(total / secs) << std::endl;
+    }
+
+    // runs the usual server threads until the supervisor sends SIGTERM
+    [[noreturn]] void WorkerMain(int index) {
+#ifdef __linux__
+        // do not outlive a supervisor that crashed
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGTERM);
+        sigaddset(&set, SIGINT);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+        int code = 0;
+        try {
+            // stdio buffers of one shared file would interleave records
+            std::unique_ptr<testing::CaptureWriter> capture;
+            if (*FLAG_capture) {
+                auto path = std::string(FLAG_capture) + '.' + std::to_string(index);
+                capture = std::make_unique<testing::CaptureWriter>(path.c_str());
+            }
+
+            auto limiter = MakeRateLimiter();
+            auto servers = StartServers(index * (FLAG_thread + 1), 0 == index, capture.get(), &stats_[index], limiter.get());
+
+            int sig;
+            sigwait(&set, &sig);
+        } catch (const testing::SocketException& e) {
+            std::cerr << e.what() << '\t' << e.error_code().message() << std::endl;
+            code = 1;
+        }
+
+        _exit(code);
+    }
+
+    int workers_;
+    WorkerStats *stats_;
+    std::vector<pid_t> pids_;
+    std::vector<int> restarts_;
+    std::vector<int> failures_;  // failed starts in a row
+    std::vector<uint64_t> started_;
+    std::vector<uint64_t> respawn_at_;
+    std::vector<uint64_t> last_packets_;
+    uint64_t last_report_ = 0;
 };
+#endif
 }
 
 int main(int argc, char *argv[]) {
@@ -81,12 +385,37 @@ int main(int argc, char *argv[]) {
     try {
 #ifdef _WIN32
         testing::WinsockInitializer<> wsock_initializer;
+#else
+        if (FLAG_connect > 0) {
+            if (!FLAG_reuseport) {
+                std::clog << "-connect needs SO_REUSEPORT, turning -reuseport on" << std::endl;
+                FLAG_reuseport = true;
+            }
+
+#ifdef __linux__
+            // one descriptor per connected peer
+            testing::RaiseOpenFileLimit();
+#endif
+        }
+
+        if (FLAG_fork > 0) {
+            if (!FLAG_reuseport) {
+                std::clog << "-fork needs SO_REUSEPORT, turning -reuseport on" << std::endl;
+                FLAG_reuseport = true;
+            }
+
+            Supervisor supervisor(FLAG_fork);
+            return supervisor.Run() ? 0 : 1;
+        }
 #endif
-        std::vector<UDPServer> udp_servers;
-        for (int i = 0; i < FLAG_thread; ++i) {
-            udp_servers.emplace_back(i);
+        std::unique_ptr<testing::CaptureWriter> capture;
+        if (*FLAG_capture) {
+            capture = std::make_unique<testing::CaptureWriter>(FLAG_capture);
         }
 
+        auto limiter = MakeRateLimiter();
+        auto udp_servers = StartServers(0, true, capture.get(), nullptr, limiter.get());
+
         std::cin.get();
     } catch (const testing::SocketException& e) {
         std::cerr << e.what() << '\t' << e.error_code().message() << std::endl;